@@ -0,0 +1,77 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * BlockCache keeps fixed-size blocks of files in memory, keyed by a file id
+ * and block number and bounded by a byte capacity. Keys are spread over
+ * shards, each with its own lock and CLOCK (second chance) eviction, so
+ * readers of unrelated blocks do not contend. Blocks are immutable and
+ * shared: a reader keeps its block alive even if it is evicted meanwhile.
+ */
+class BlockCache
+{
+public:
+    using Block = std::shared_ptr<const std::vector<uint8_t>>;
+
+    BlockCache(size_t capacity, size_t block_size = 65536, size_t shards = 16);
+
+    // Disallow copying
+    BlockCache(const BlockCache &) = delete;
+    BlockCache &operator=(const BlockCache &) = delete;
+
+    Block Lookup(uint64_t file, uint64_t block);
+    void Insert(uint64_t file, uint64_t block, Block data);
+    void Clear();
+
+    size_t BlockSize() const { return block_size_; }
+    size_t Capacity() const;
+    size_t Usage() const;
+
+private:
+    struct Key
+    {
+        uint64_t file;
+        uint64_t block;
+        bool operator==(const Key &other) const
+        {
+            return file == other.file && block == other.block;
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const;
+    };
+
+    struct Slot
+    {
+        Key key;
+        Block data;
+        bool referenced;
+    };
+
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::unordered_map<Key, size_t, KeyHash> index; // key -> slot
+        std::vector<Slot> slots;                        // the clock ring
+        size_t hand = 0;
+        size_t usage = 0;
+        size_t capacity = 0;
+    };
+
+    Shard &shardFor(const Key &key);
+    static void evict(Shard &shard, size_t need);
+
+    size_t block_size_;
+    size_t nshards_;
+    std::unique_ptr<Shard[]> shards_;
+};
+
+#endif // BLOCK_CACHE_H
@@ -4,12 +4,36 @@
 
 #include <vector>
 #include <cstdint>
+#include <functional>
 #include <string>
 
 std::string base64_encode(const uint8_t *buf, size_t bufLen, bool url_safe = false);
 std::vector<uint8_t> base64_decode(const std::string &encoded_string);
+std::vector<uint8_t> base64_decode(const uint8_t *in, size_t len);
+
+// True if buf is UTF-8 that can sit unescaped inside a JSON string
+bool IsPlainUTF8(const uint8_t *buf, size_t len);
+
+// Number of bytes equal to `byte` in buf
+size_t CountByte(const uint8_t *buf, size_t len, uint8_t byte);
+
+// CRC-32C (Castagnoli). Pass a previous result as `crc` to continue it.
+uint32_t Crc32c(const uint8_t *buf, size_t len, uint32_t crc = 0);
 
 size_t ReadVarint(const uint8_t *buf, size_t bufLen, uint64_t *value);
 void WriteVarint(uint64_t value, std::vector<uint8_t> &out);
 
+// File name of the segment starting at `index`: 20 zero-padded digits
+std::string SegmentName(uint64_t index);
+
+// fsync a file or directory by path
+void SyncPath(const std::string &path);
+
+// Creates or replaces a file with `data` and fsyncs it
+bool WriteFileSync(const std::string &path, const void *data, size_t size, uint32_t perms);
+
+// Runs fn(0) .. fn(count - 1) at once, fn(0) on the calling thread, and
+// rethrows the first error once all have finished
+void RunParallel(size_t count, const std::function<void(size_t)> &fn);
+
 #endif // UTILS_H
\ No newline at end of file
@@ -1,7 +1,7 @@
 #ifndef WAL_H
 #define WAL_H
 
-#include "tinyLRU.hpp"
+#include "block_cache.h"
 
 #include <cstdint>
 #include <string>
@@ -11,6 +11,14 @@
 #include <fstream>
 #include <unordered_map>
 #include <functional>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <thread>
 
 #include <filesystem>
 namespace fs = std::filesystem;
@@ -18,34 +26,81 @@ namespace fs = std::filesystem;
 class WAL
 {
 public:
+    // Binary and BinaryV2 logs read each other's segments: the version is
+    // detected per segment, and only new segments use the configured one.
+    // BinaryV2 segments start with a header (magic, version, base index)
+    // and every record has a fixed 12 byte header with length, flags and a
+    // CRC-32C over index, flags and payload.
     enum class LogFormat
     {
         Binary = 0,
-        JSON = 1
+        JSON = 1,
+        BinaryV2 = 2
+    };
+
+    // Fixed-size metadata stored with an entry's record (BinaryV2 and JSON
+    // logs), e.g. its Raft term. All zero means none.
+    struct EntryMeta
+    {
+        uint64_t term = 0;
+        uint32_t type = 0;
+
+        bool operator==(const EntryMeta &o) const
+        {
+            return term == o.term && type == o.type;
+        }
     };
 
     struct BatchEntry
     {
         uint64_t index;
         size_t size;
+        EntryMeta meta{};
+    };
+
+    // An entry to write whose payload stays in caller memory
+    struct EntryRef
+    {
+        uint64_t index;
+        const uint8_t *data;
+        size_t size;
+        EntryMeta meta{};
     };
 
     class Batch
     {
     public:
         void Write(uint64_t index, const std::vector<uint8_t> &data);
+        void Write(uint64_t index, std::vector<uint8_t> &&data);
+        void Write(uint64_t index, const uint8_t *data, size_t size);
+        void Write(uint64_t index, const uint8_t *data, size_t size, const EntryMeta &meta);
         void Clear();
 
         std::vector<BatchEntry> entries;
         std::vector<uint8_t> datas;
     };
 
+    // Completion of WriteAsync: the batch's last index, or the error that
+    // kept it from becoming durable
+    using WriteCallback = std::function<void(uint64_t index, std::exception_ptr error)>;
+
+    // Source of Import: fills in the next entry and returns true, or returns
+    // false at the end. The payload only has to live until the next call.
+    using ImportSource = std::function<bool(EntryRef &entry)>;
+
     struct Segment
     {
         std::string path;
         uint64_t index;
+        // Block cache key; renewed whenever the file's bytes are rewritten
+        uint64_t id = NewSegmentId();
+        LogFormat format = LogFormat::Binary; // known once created or loaded
         std::vector<uint8_t> ebuf;
         std::vector<std::pair<size_t, size_t>> epos; // start and end positions
+        // Metadata of the entries up to the last one that has any. Sealed
+        // segments found on open fill it on their first ReadMeta.
+        std::vector<EntryMeta> meta;
+        bool meta_loaded = false;
     };
 
     struct Options
@@ -54,9 +109,43 @@ public:
         size_t segment_size = 20971520; // 20MB
         LogFormat log_format = LogFormat::Binary;
         size_t segment_cache_size = 2;
+        // Bytes of sealed segment data kept in the block cache; 0 sizes it
+        // as segment_cache_size segments
+        size_t block_cache_size = 0;
         bool no_copy = false;
         uint32_t dir_perms = 0750;
         uint32_t file_perms = 0640;
+        // Rewrite the manifest as a snapshot after this many appended edits
+        size_t manifest_compact_edits = 1024;
+        // Decode every segment on open instead of only the tail
+        bool verify_on_open = false;
+        size_t verify_threads = 0; // 0 = hardware concurrency
+        // Load the next segment in the background for sequential readers
+        bool readahead = true;
+        // Sync policy when no_sync is false. With all three at 0 every write
+        // is fdatasynced before it returns. Otherwise writes only flush and a
+        // background thread syncs once the oldest unsynced write is
+        // sync_interval_ms old, or sync_bytes or sync_entries have built up.
+        size_t sync_interval_ms = 0;
+        size_t sync_bytes = 0;
+        size_t sync_entries = 0;
+        // Tiered storage: with cold_dir set, a background thread moves
+        // sealed segments there once they are cold_after_entries entries
+        // behind the last index or were last written cold_after_ms ago.
+        // With both at 0 a segment moves as soon as it is sealed.
+        std::string cold_dir;
+        uint64_t cold_after_entries = 0;
+        size_t cold_after_ms = 0;
+        // Payloads of at least this many bytes go to the segment's blob
+        // file (`<segment>.blob`) and the record keeps only a reference.
+        // BinaryV2 and JSON logs only, as Binary records have no flags.
+        // 0 keeps every payload inline.
+        size_t blob_threshold = 0;
+
+        // Append to the tail through a shared mapping of its preallocated
+        // file instead of the file stream: one memcpy per write and no
+        // write(2). BinaryV2 and JSON logs only; durability is unchanged.
+        bool mmap_tail = false;
     };
 
     static const Options DefaultOptions;
@@ -72,50 +161,276 @@ public:
 
     // Core operations
     void Write(uint64_t index, const std::vector<uint8_t> &data);
+    void Write(uint64_t index, std::vector<uint8_t> &&data);
+    void Write(uint64_t index, const uint8_t *data, size_t size);
+    void Write(uint64_t index, const uint8_t *data, size_t size, const EntryMeta &meta);
     std::vector<uint8_t> Read(uint64_t index);
+    // ReadMeta returns an entry's metadata from memory without touching its
+    // payload; the range form returns [first, last].
+    EntryMeta ReadMeta(uint64_t index);
+    std::vector<EntryMeta> ReadMeta(uint64_t first, uint64_t last);
+    // Reserve returns `size` writable bytes for the entry at `index`. In
+    // binary format the region lives in the tail segment buffer itself. It
+    // stays valid until the next Reserve, Commit or Abort. Commit writes all
+    // reserved entries at once; Abort drops them.
+    uint8_t *Reserve(uint64_t index, size_t size);
+    void Commit();
+    void Abort();
+    // AppendNext writes the entry at the next free index and returns it.
+    // Producers publish to a lock-free queue; whoever then holds the log
+    // writes every queued entry as one batch.
+    uint64_t AppendNext(const std::vector<uint8_t> &data);
+    uint64_t AppendNext(const uint8_t *data, size_t size);
     uint64_t FirstIndex();
     uint64_t LastIndex();
+    // Highest index known to be on stable storage
+    uint64_t DurableIndex();
     void WriteBatch(Batch *batch);
+    // WriteAsync writes the batch like WriteBatch but returns before it is
+    // synced. The future resolves, or the callback runs on the sync thread,
+    // with the batch's last index once it is durable. Completions arrive in
+    // index order; a batch removed by TruncateBack or left unsynced by Close
+    // completes with an error.
+    std::future<uint64_t> WriteAsync(Batch *batch);
+    void WriteAsync(Batch *batch, WriteCallback done);
+    // Import appends the entries `next` yields, which continue from
+    // LastIndex, as whole segments encoded on `threads` threads (0 =
+    // hardware concurrency) and attached in one step. Returns the new last
+    // index. Payloads are stored inline even with blob_threshold set.
+    uint64_t Import(const ImportSource &next, size_t threads = 0);
     void TruncateFront(uint64_t index);
     void TruncateBack(uint64_t index);
     void Sync();
     void Close();
     void ClearCache();
+    // Writes a consistent copy of the log to the empty directory `dir`:
+    // sealed segments are hard linked, the tail's written prefix is copied.
+    // Writers are blocked only while the state is captured.
+    void Checkpoint(const std::string &dir);
+    // Writes the stored records of entries [from, to] to `fd` (a file,
+    // pipe or blocking socket) in the log's format and returns the byte
+    // count. The bytes are moved by the kernel straight from the segment
+    // files. Ranges holding an entry whose value is in a blob file are
+    // refused, and a TruncateBack that races the copy fails it with "entry
+    // truncated".
+    uint64_t ExportRange(uint64_t from, uint64_t to, int fd);
     void PrintSegmentInfo();
 
+    // Rewrites the log at `path` from one format and segment size to another,
+    // converting segments on `threads` threads (0 = hardware concurrency).
+    // The log must not be open while it runs.
+    static void Convert(const std::string &path, const Options &from,
+                        const Options &to, size_t threads = 0);
+
 private:
+    friend struct WALTestAccess; // test/test_wal.cpp
+
     void load();
-    void loadSegmentEntries(std::shared_ptr<Segment> segment);
+    void scanSegments();
+    void readManifest();
+    void writeManifest();
+    void appendManifest(const std::string &edit);
+    void loadSegmentEntries(std::shared_ptr<Segment> segment,
+                            size_t max_entries = SIZE_MAX);
+    void verifySegments();
+    void loadSegmentMeta(const std::shared_ptr<Segment> &seg);
     int findSegment(uint64_t index) const;
+    void indexSegments();
     std::shared_ptr<Segment> loadSegment(uint64_t index);
+    struct ColdRead
+    {
+        std::string path;
+        uint64_t id;
+        uint64_t index;
+        size_t entry;      // position in the segment
+        bool bounded;      // start, end and format are known without the index
+        LogFormat format;
+        uint64_t start;
+        uint64_t end;
+    };
+    ColdRead coldRead(const std::shared_ptr<Segment> &seg, uint64_t index) const;
+    bool readCold(ColdRead &req, std::vector<uint8_t> *out);
+    bool readRange(const std::string &path, uint64_t file, uint64_t start,
+                   uint64_t end, std::vector<uint8_t> *out);
+    bool entryRange(const Segment &seg, size_t a, size_t b, LogFormat *format,
+                    uint64_t *start, uint64_t *end);
+    static bool rangeHasBlobs(int fd, uint64_t start, uint64_t end, uint64_t index,
+                              LogFormat format);
+    bool writeSegmentIndex(const Segment &seg);
+    void rebuildSegmentIndex(int seg_idx);
+    void seedCache(const Segment &seg);
     void cycleSegment
     ();
-    void writeBatchInternal(Batch *batch);
+    void sealTail();
+    void writeBatchInternal(Batch *batch, bool defer_sync = false);
+    void writeEntriesInternal(const EntryRef *entries, size_t count,
+                              bool defer_sync = false);
+    template <typename Codec>
+    size_t appendToTail(const EntryRef *entries, size_t count);
+    void drainAppendsInternal();
     void truncateFrontInternal(uint64_t index);
     void truncateBackInternal(uint64_t index);
-    void pushCache(int seg_idx);
+    void maybeReadahead(const std::shared_ptr<Segment> &seg, uint64_t index);
+    void readaheadLoop();
+    void stopReadahead();
+    // Blocks until the segments queued for readahead are in the cache
+    void waitReadahead();
     void clearCacheInternal();
+    void initSegment(Segment &seg, std::ostream &out);
+    bool backgroundSync() const;
+    void openSyncFd();
+    void mapTail(size_t need);
+    void unmapTail();
+    void writeTail(size_t from);
+    void trimPreallocated(const std::string &path, uint64_t index) const;
+    void syncWritten(size_t bytes, size_t entries, bool defer_sync);
+    void syncLoop();
+    void stopSync();
+    struct AsyncWrite;
+    bool asyncReady() const;
+    std::vector<AsyncWrite> takeAsyncWrites(const char *fail_rest);
+    static void completeAsyncWrites(std::vector<AsyncWrite> &writes);
+    bool isCold(const Segment &seg) const;
+    void resolveTiers();
+    std::shared_ptr<Segment> pickColdSegment(std::chrono::system_clock::time_point *wake);
+    bool moveToColdTier(const std::shared_ptr<Segment> &seg,
+                        std::unique_lock<std::mutex> &lock);
+    void tierLoop();
+    void stopTiering();
 
+    static uint64_t NewSegmentId();
     static std::string segmentName(uint64_t index);
-    static std::pair<std::vector<uint8_t>, std::pair<size_t, size_t>>
-    appendEntry(const std::vector<uint8_t> &dst, uint64_t index,
-                const std::vector<uint8_t> &data, LogFormat format);
-    static std::vector<uint8_t> readJSON(const std::vector<uint8_t> &edata);
-    static std::vector<uint8_t> readBinary(const std::vector<uint8_t> &edata, bool no_copy);
+    static std::string indexPath(const std::string &segment_path);
+    static std::vector<uint8_t> segmentHeader(uint64_t index);
+    static size_t segmentHeaderSize(LogFormat format);
+    static LogFormat detectFormat(const std::vector<uint8_t> &buf, uint64_t index,
+                                  LogFormat configured);
+    static void sealRecord(uint8_t *record, uint64_t index);
+    static std::pair<size_t, size_t>
+    appendEntry(std::vector<uint8_t> &dst, uint64_t index,
+                const uint8_t *data, size_t size, LogFormat format,
+                const EntryMeta &meta);
+    static bool scanEntries(const std::vector<uint8_t> &buf, LogFormat format,
+                            size_t max_entries,
+                            std::vector<std::pair<size_t, size_t>> &epos);
+    static std::vector<uint8_t> readEntry(const uint8_t *edata, size_t esize,
+                                          uint64_t index, LogFormat format,
+                                          uint32_t *flags, EntryMeta *meta = nullptr);
+    static std::string blobPath(const std::string &segment_path);
+    static std::string preallocPath(const std::string &segment_path);
+    void appendBlob(const uint8_t *data, size_t size, uint8_t *ref);
+    void syncBlob();
+    void closeBlob();
+    void forgetUnsynced(const std::string &segment_path);
+    static bool readBlob(const std::string &segment_path, const std::vector<uint8_t> &ref,
+                         std::vector<uint8_t> *out);
 
     mutable std::mutex mutex_;
     std::string path_;
     Options options_;
     bool closed_ = false;
     bool corrupt_ = false;
+    bool importing_ = false; // Import is building segments
 
     uint64_t first_index_ = 0;
     uint64_t last_index_ = 0;
     std::unique_ptr<std::fstream> sfile_;
-    Batch wbatch_;
 
-    // Simple LRU cache implementation
-    tinylru::tinyLRU<int, std::shared_ptr<Segment>> scache_;
+    // Flat directory of segments_ for findSegment, rebuilt by
+    // indexSegments whenever the segment list changes: the start indexes
+    // in order, the same keys in Eytzinger (BFS, 1-based) order with each
+    // slot's rank, and the position last found.
+    std::vector<uint64_t> seg_starts_;
+    std::vector<uint64_t> seg_eytz_;
+    std::vector<uint32_t> seg_rank_;
+    mutable size_t seg_hint_ = 0;
+
+    // Entries handed out by Reserve and not yet committed. Binary payloads
+    // are in the tail ebuf from reserved_mark_ on; JSON ones are staged in
+    // reserved_.datas until Commit encodes them.
+    Batch reserved_;
+    std::vector<std::pair<size_t, size_t>> reserved_pos_;
+    size_t reserved_mark_ = 0;
+
+    // Pending AppendNext calls, pushed lock-free (newest first). A node
+    // lives on its producer's stack until a drainer marks it done.
+    struct AppendNode
+    {
+        EntryRef entry;
+        AppendNode *next = nullptr;
+        bool done = false; // guarded by mutex_
+        std::exception_ptr error;
+    };
+    std::atomic<AppendNode *> append_head_{nullptr};
+
+    // Append-only record of segment adds, removals and logical truncations
+    int manifest_fd_ = -1;
+    size_t manifest_edits_ = 0;
+    // Last index of the tail from a `back` edit whose cut may not have
+    // reached the file; 0 when the tail is unbounded
+    uint64_t manifest_back_ = 0;
+
+    // Sealed segment and offset index blocks, keyed by segment id (x2,
+    // +1 for the index). Read outside mutex_; cut_gen_ moves on every back
+    // truncation so readers that raced one retry.
+    std::unique_ptr<BlockCache> bcache_;
+    std::atomic<uint64_t> cut_gen_{0};
+
+    // Durability. sync_fd_ is a second descriptor on the tail for fdatasync;
+    // the sync thread waits on sync_cv_ with mutex_.
+    int sync_fd_ = -1;
+    uint64_t durable_index_ = 0;
+    std::vector<std::string> unsynced_segments_; // sealed under no_sync
+
+    // Blob file of the tail, opened on its first large value
+    int blob_fd_ = -1;
+    uint64_t blob_size_ = 0;
+    bool blob_dirty_ = false; // written since the last sync
+    size_t unsynced_bytes_ = 0;
+    size_t unsynced_entries_ = 0;
+    std::chrono::steady_clock::time_point unsynced_since_;
+    std::condition_variable sync_cv_;
+    bool sync_stop_ = false;
+    std::thread sync_thread_;
+
+    // Shared mapping of the tail with mmap_tail. The file is preallocated
+    // to tail_map_len_; tail_map_used_ bytes of it are log.
+    uint8_t *tail_map_ = nullptr;
+    size_t tail_map_len_ = 0;
+    size_t tail_map_used_ = 0;
+
+    // WriteAsync batches waiting to be durable, in index order. The sync
+    // thread is started by the first one if no policy started it already.
+    struct AsyncWrite
+    {
+        uint64_t index;
+        WriteCallback done;
+        std::exception_ptr error;
+    };
+    std::deque<AsyncWrite> async_writes_;
+
+    // Cold tier directory (absolute, empty if disabled). Segments there are
+    // found through their path; the tier thread waits on tier_cv_ with
+    // mutex_.
+    std::string cold_path_;
+    std::condition_variable tier_cv_;
+    bool tier_stop_ = false;
+    std::thread tier_thread_;
+
+    // Readahead of cold segments into the block cache. Lock order: mutex_
+    // before ra_mutex_.
+    struct ReadaheadRequest
+    {
+        std::string path;
+        uint64_t id;
+    };
+    uint64_t last_read_ = 0;
+    std::mutex ra_mutex_;
+    std::condition_variable ra_cv_;
+    std::deque<ReadaheadRequest> ra_queue_;
+    std::set<uint64_t> ra_pending_; // segment ids queued or loading
+    bool ra_stop_ = false;
+    std::thread ra_thread_;
 };
 
 #endif // WAL_H
\ No newline at end of file
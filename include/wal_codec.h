@@ -0,0 +1,186 @@
+#ifndef WAL_CODEC_H
+#define WAL_CODEC_H
+
+#include "wal.h"
+#include "utils.h"
+
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+// One type per LogFormat with static encode, scan and decode. Record loops
+// are templates over a codec; WithCodec picks the instantiation per call.
+namespace wal_codec
+{
+    using Positions = std::vector<std::pair<size_t, size_t>>;
+
+    // Record flag: the payload is a blob reference, not the value. Binary
+    // records have no flags and always hold the value.
+    constexpr uint32_t blob_flag = 1;
+    // Record flag: the payload starts with the entry's metadata
+    constexpr uint32_t meta_flag = 2;
+
+    inline bool HasMeta(const WAL::EntryMeta &meta)
+    {
+        return meta.term != 0 || meta.type != 0;
+    }
+
+    // varint length + payload
+    struct Binary
+    {
+        static constexpr WAL::LogFormat format = WAL::LogFormat::Binary;
+        static constexpr size_t segment_header_size = 0;
+
+        static constexpr bool has_flags = false;
+
+        static void Append(std::vector<uint8_t> &dst, uint64_t index,
+                           const uint8_t *data, size_t size, uint32_t flags = 0,
+                           const WAL::EntryMeta &meta = {})
+        {
+            (void)index;
+            (void)flags;
+            if (HasMeta(meta))
+            {
+                throw std::runtime_error("entry metadata needs BinaryV2 or JSON");
+            }
+            WriteVarint(size, dst);
+            dst.insert(dst.end(), data, data + size);
+        }
+        static bool Scan(const uint8_t *p, size_t size, size_t max_entries, Positions &epos);
+        static std::vector<uint8_t> Decode(const uint8_t *edata, size_t esize, uint64_t index,
+                                           uint32_t *flags = nullptr,
+                                           WAL::EntryMeta *meta = nullptr);
+        static bool DecodeMeta(const uint8_t *, size_t, WAL::EntryMeta *)
+        {
+            return false;
+        }
+    };
+
+    // u32 length, u32 flags, u32 CRC-32C + payload, after a segment header.
+    // With meta_flag the payload starts with u64 term and u32 type.
+    struct BinaryV2
+    {
+        static constexpr WAL::LogFormat format = WAL::LogFormat::BinaryV2;
+        static constexpr size_t segment_header_size = 32;
+        static constexpr size_t record_header_size = 12;
+        static constexpr size_t meta_size = 12;
+        static constexpr bool has_flags = true;
+
+        static void Append(std::vector<uint8_t> &dst, uint64_t index,
+                           const uint8_t *data, size_t size, uint32_t flags = 0,
+                           const WAL::EntryMeta &meta = {})
+        {
+            size_t prefix = 0;
+            if (HasMeta(meta))
+            {
+                flags |= meta_flag;
+                prefix = meta_size;
+            }
+            if (size > UINT32_MAX - prefix)
+            {
+                throw std::runtime_error("entry too large");
+            }
+            size_t pos = dst.size();
+            dst.resize(pos + record_header_size + prefix + size);
+            uint8_t *record = dst.data() + pos;
+            uint32_t len = static_cast<uint32_t>(prefix + size);
+            std::memcpy(record, &len, 4);
+            std::memcpy(record + 4, &flags, 4);
+            if (prefix > 0)
+            {
+                std::memcpy(record + record_header_size, &meta.term, 8);
+                std::memcpy(record + record_header_size + 8, &meta.type, 4);
+            }
+            if (size > 0)
+            {
+                std::memcpy(record + record_header_size + prefix, data, size);
+            }
+            Seal(record, index);
+        }
+        static bool Scan(const uint8_t *p, size_t size, size_t max_entries, Positions &epos);
+        static std::vector<uint8_t> Decode(const uint8_t *edata, size_t esize, uint64_t index,
+                                           uint32_t *flags = nullptr,
+                                           WAL::EntryMeta *meta = nullptr);
+        // Reads the metadata of a framed record without checking its CRC
+        static bool DecodeMeta(const uint8_t *edata, size_t esize, WAL::EntryMeta *meta);
+
+        // CRC over index, flags and payload of a record whose length is set
+        static uint32_t RecordCrc(const uint8_t *record, uint64_t index);
+        static void Seal(uint8_t *record, uint64_t index)
+        {
+            uint32_t crc = RecordCrc(record, index);
+            std::memcpy(record + 8, &crc, 4);
+        }
+    };
+
+    // {"index":"number","data":"+utf8" or "$base64"}\n; a blob reference
+    // is "@base64". Metadata goes between the two as "term":"number",
+    // "type":"number".
+    struct Json
+    {
+        static constexpr WAL::LogFormat format = WAL::LogFormat::JSON;
+        static constexpr size_t segment_header_size = 0;
+        static constexpr bool has_flags = true;
+
+        static void Append(std::vector<uint8_t> &dst, uint64_t index,
+                           const uint8_t *data, size_t size, uint32_t flags = 0,
+                           const WAL::EntryMeta &meta = {})
+        {
+            static const char head[] = "{\"index\":\"";
+            static const char term[] = "\",\"term\":\"";
+            static const char type[] = "\",\"type\":\"";
+            static const char mid[] = "\",\"data\":\"";
+            static const char tail[] = "\"}\n";
+            char digits[20];
+            char *digits_end = std::to_chars(digits, digits + sizeof(digits), index).ptr;
+
+            dst.insert(dst.end(), head, head + 10);
+            dst.insert(dst.end(), digits, digits_end);
+            if (HasMeta(meta))
+            {
+                dst.insert(dst.end(), term, term + 10);
+                digits_end = std::to_chars(digits, digits + sizeof(digits), meta.term).ptr;
+                dst.insert(dst.end(), digits, digits_end);
+                dst.insert(dst.end(), type, type + 10);
+                digits_end = std::to_chars(digits, digits + sizeof(digits), meta.type).ptr;
+                dst.insert(dst.end(), digits, digits_end);
+            }
+            dst.insert(dst.end(), mid, mid + 10);
+            // Valid UTF-8 without characters that break the record framing
+            // is stored as is, anything else as base64
+            if (!(flags & blob_flag) && IsPlainUTF8(data, size))
+            {
+                dst.push_back('+');
+                dst.insert(dst.end(), data, data + size);
+            }
+            else
+            {
+                dst.push_back(flags & blob_flag ? '@' : '$');
+                std::string encoded = base64_encode(data, size, false);
+                dst.insert(dst.end(), encoded.begin(), encoded.end());
+            }
+            dst.insert(dst.end(), tail, tail + 3);
+        }
+        static bool Scan(const uint8_t *p, size_t size, size_t max_entries, Positions &epos);
+        static std::vector<uint8_t> Decode(const uint8_t *edata, size_t esize, uint64_t index,
+                                           uint32_t *flags = nullptr,
+                                           WAL::EntryMeta *meta = nullptr);
+        static bool DecodeMeta(const uint8_t *edata, size_t esize, WAL::EntryMeta *meta);
+    };
+
+    template <typename F>
+    decltype(auto) WithCodec(WAL::LogFormat format, F &&f)
+    {
+        switch (format)
+        {
+        case WAL::LogFormat::JSON:
+            return f(Json{});
+        case WAL::LogFormat::BinaryV2:
+            return f(BinaryV2{});
+        default:
+            return f(Binary{});
+        }
+    }
+}
+
+#endif // WAL_CODEC_H
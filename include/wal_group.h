@@ -0,0 +1,132 @@
+#ifndef WAL_GROUP_H
+#define WAL_GROUP_H
+
+#include "wal.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * WALGroup hosts many logical logs (for example one per Raft group) in one
+ * directory. Every log has its own index space, reads and truncations, but
+ * appends and truncations from all of them are multiplexed onto shared
+ * segment files and made durable together: concurrent callers queue their
+ * records and one of them writes the whole queue and syncs once for all.
+ */
+class WALGroup
+{
+public:
+    struct Options
+    {
+        bool no_sync = false;
+        size_t segment_size = 20971520; // 20MB
+        uint32_t file_perms = 0640;
+    };
+
+    static const Options DefaultOptions;
+
+    WALGroup(const std::string &path, const Options &options = DefaultOptions);
+    ~WALGroup();
+
+    // Disallow copying
+    WALGroup(const WALGroup &) = delete;
+    WALGroup &operator=(const WALGroup &) = delete;
+
+    // Core operations, all scoped to one logical log
+    void Write(uint64_t log, uint64_t index, const std::vector<uint8_t> &data);
+    void WriteBatch(uint64_t log, WAL::Batch *batch);
+    std::vector<uint8_t> Read(uint64_t log, uint64_t index);
+    uint64_t FirstIndex(uint64_t log);
+    uint64_t LastIndex(uint64_t log);
+    void TruncateFront(uint64_t log, uint64_t index);
+    void TruncateBack(uint64_t log, uint64_t index);
+    std::vector<uint64_t> Logs();
+    void Sync();
+    void Close();
+
+private:
+    enum RecordType : uint8_t
+    {
+        Append = 'A',
+        Front = 'F',
+        Back = 'B'
+    };
+
+    struct SegmentFile
+    {
+        uint64_t id = 0;
+        std::string path;
+        int fd = -1;
+        size_t size = 0;
+        size_t live = 0; // committed entries still referenced by a log
+        ~SegmentFile();
+    };
+
+    struct Location
+    {
+        std::shared_ptr<SegmentFile> seg;
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    struct Log
+    {
+        // Committed state, served to readers
+        uint64_t first_index = 1;
+        std::deque<Location> entries;
+        // State including queued records, used to validate new requests
+        uint64_t next_first = 1;
+        uint64_t next_last = 0;
+    };
+
+    struct Record
+    {
+        RecordType type;
+        uint64_t log;
+        uint64_t index;
+        size_t start;  // record bounds in the queue buffer
+        size_t end;
+        size_t data;   // payload offset in the queue buffer
+    };
+
+    void load();
+    void replaySegment(const std::shared_ptr<SegmentFile> &seg, bool tail);
+    void applyRecord(RecordType type, uint64_t log, uint64_t index,
+                     const Location &loc);
+    uint64_t enqueue(RecordType type, uint64_t log, uint64_t index,
+                     const uint8_t *data, size_t size);
+    void commit(std::unique_lock<std::mutex> &lock, uint64_t seq);
+    void writeRecords(const std::vector<uint8_t> &buf,
+                      const std::vector<Record> &recs,
+                      std::vector<Location> &locs,
+                      std::vector<std::shared_ptr<SegmentFile>> &opened);
+    std::shared_ptr<SegmentFile> openSegment(uint64_t id, bool create);
+    void reclaimSegments();
+    void checkOpen() const;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::string path_;
+    Options options_;
+    bool closed_ = false;
+    bool corrupt_ = false;
+
+    std::map<uint64_t, Log> logs_;
+    std::deque<std::shared_ptr<SegmentFile>> segments_;
+    std::shared_ptr<SegmentFile> active_; // only touched by the committer
+
+    // Group commit queue
+    std::vector<uint8_t> pending_;
+    std::vector<Record> pending_recs_;
+    uint64_t pending_seq_ = 0;
+    uint64_t durable_seq_ = 0;
+    bool committing_ = false;
+};
+
+#endif // WAL_GROUP_H
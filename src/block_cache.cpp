@@ -0,0 +1,142 @@
+#include "block_cache.h"
+
+BlockCache::BlockCache(size_t capacity, size_t block_size, size_t shards)
+    : block_size_(block_size), nshards_(shards == 0 ? 1 : shards),
+      shards_(new Shard[nshards_])
+{
+    for (size_t i = 0; i < nshards_; i++)
+    {
+        shards_[i].capacity = capacity / nshards_;
+    }
+}
+
+size_t BlockCache::KeyHash::operator()(const Key &key) const
+{
+    // 64-bit mix (splitmix64 finalizer) of both halves
+    uint64_t h = key.file * 0x9e3779b97f4a7c15ULL ^ key.block;
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return static_cast<size_t>(h);
+}
+
+BlockCache::Shard &BlockCache::shardFor(const Key &key)
+{
+    // The high bits pick the shard, the map uses the rest
+    uint64_t h = KeyHash()(key);
+    return shards_[(h >> 48) % nshards_];
+}
+
+BlockCache::Block BlockCache::Lookup(uint64_t file, uint64_t block)
+{
+    Key key{file, block};
+    Shard &shard = shardFor(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end())
+    {
+        return nullptr;
+    }
+    Slot &slot = shard.slots[it->second];
+    slot.referenced = true;
+    return slot.data;
+}
+
+void BlockCache::Insert(uint64_t file, uint64_t block, Block data)
+{
+    if (!data)
+    {
+        return;
+    }
+    Key key{file, block};
+    Shard &shard = shardFor(key);
+    size_t size = data->size();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (size > shard.capacity)
+    {
+        return;
+    }
+
+    auto it = shard.index.find(key);
+    if (it != shard.index.end())
+    {
+        Slot &slot = shard.slots[it->second];
+        shard.usage -= slot.data->size();
+        slot.data = std::move(data);
+        shard.usage += size;
+        evict(shard, 0);
+        return;
+    }
+
+    evict(shard, size);
+    // New blocks start unreferenced, so a scan that is never read again
+    // (readahead overshoot, a one-off export) is the first to go.
+    shard.index.emplace(key, shard.slots.size());
+    shard.slots.push_back({key, std::move(data), false});
+    shard.usage += size;
+}
+
+// Sweeps the clock hand until `need` more bytes fit in the shard
+void BlockCache::evict(Shard &shard, size_t need)
+{
+    while (!shard.slots.empty() && shard.usage + need > shard.capacity)
+    {
+        if (shard.hand >= shard.slots.size())
+        {
+            shard.hand = 0;
+        }
+        Slot &slot = shard.slots[shard.hand];
+        if (slot.referenced)
+        {
+            slot.referenced = false;
+            shard.hand++;
+            continue;
+        }
+
+        shard.usage -= slot.data->size();
+        shard.index.erase(slot.key);
+        // Fill the hole with the last slot; the hand stays to look at it
+        if (shard.hand != shard.slots.size() - 1)
+        {
+            slot = std::move(shard.slots.back());
+            shard.index[slot.key] = shard.hand;
+        }
+        shard.slots.pop_back();
+    }
+}
+
+void BlockCache::Clear()
+{
+    for (size_t i = 0; i < nshards_; i++)
+    {
+        Shard &shard = shards_[i];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.index.clear();
+        shard.slots.clear();
+        shard.hand = 0;
+        shard.usage = 0;
+    }
+}
+
+size_t BlockCache::Capacity() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < nshards_; i++)
+    {
+        total += shards_[i].capacity;
+    }
+    return total;
+}
+
+size_t BlockCache::Usage() const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < nshards_; i++)
+    {
+        std::lock_guard<std::mutex> lock(shards_[i].mutex);
+        total += shards_[i].usage;
+    }
+    return total;
+}
@@ -1,215 +1,562 @@
 #include "wal.h"
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
 
 // Base64 encoding/decoding functions
-static const std::string base64_chars =
+//
+// Scalar table driven code is the fallback everywhere. On x86 the SSSE3
+// kernels (12 bytes <-> 16 characters per step, after Wojciech Mula's
+// pshufb base64 work) are picked at runtime; other targets stay scalar.
+static const char base64_std[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
     "abcdefghijklmnopqrstuvwxyz"
     "0123456789+/";
+static const char base64_url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz"
+    "0123456789-_";
 
-std::string base64_encode(const uint8_t *buf, size_t bufLen, bool url_safe)
+// Character to 6-bit value, -1 for anything else. Both alphabets decode.
+struct Base64DecodeTable
 {
-    std::string ret;
-    int i = 0;
-    int j = 0;
-    uint8_t char_array_3[3];
-    uint8_t char_array_4[4];
+    int8_t v[256];
+    Base64DecodeTable()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            v[i] = -1;
+        }
+        for (int i = 0; i < 64; i++)
+        {
+            v[static_cast<uint8_t>(base64_std[i])] = static_cast<int8_t>(i);
+            v[static_cast<uint8_t>(base64_url[i])] = static_cast<int8_t>(i);
+        }
+    }
+};
+static const Base64DecodeTable base64_rev;
 
-    while (bufLen--)
+static void base64_encode_scalar(const uint8_t *in, size_t len, char *out,
+                                 const char *alphabet)
+{
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3)
+    {
+        uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        *out++ = alphabet[(v >> 18) & 0x3f];
+        *out++ = alphabet[(v >> 12) & 0x3f];
+        *out++ = alphabet[(v >> 6) & 0x3f];
+        *out++ = alphabet[v & 0x3f];
+    }
+    if (i < len)
     {
-        char_array_3[i++] = *(buf++);
-        if (i == 3)
+        uint32_t v = in[i] << 16;
+        if (i + 1 < len)
         {
-            char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-            char_array_4[1] = ((char_array_3[0] & 0x03) << 4) +
-                              ((char_array_3[1] & 0xf0) >> 4);
-            char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) +
-                              ((char_array_3[2] & 0xc0) >> 6);
-            char_array_4[3] = char_array_3[2] & 0x3f;
+            v |= in[i + 1] << 8;
+        }
+        *out++ = alphabet[(v >> 18) & 0x3f];
+        *out++ = alphabet[(v >> 12) & 0x3f];
+        *out++ = i + 1 < len ? alphabet[(v >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+}
 
-            for (i = 0; i < 4; i++)
-            {
-                if (url_safe)
-                {
-                    if (base64_chars[char_array_4[i]] == '+')
-                    {
-                        ret += '-';
-                    }
-                    else if (base64_chars[char_array_4[i]] == '/')
-                    {
-                        ret += '_';
-                    }
-                    else
-                    {
-                        ret += base64_chars[char_array_4[i]];
-                    }
-                }
-                else
-                {
-                    ret += base64_chars[char_array_4[i]];
-                }
-            }
-            i = 0;
+// Decodes until the first '=' or character outside both alphabets, the
+// same stopping rule the log has always used. Returns bytes written.
+static size_t base64_decode_scalar(const uint8_t *in, size_t len, uint8_t *out)
+{
+    uint8_t *start = out;
+    uint32_t acc = 0;
+    int n = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        int8_t v = base64_rev.v[in[i]];
+        if (v < 0)
+        {
+            break;
+        }
+        acc = (acc << 6) | static_cast<uint32_t>(v);
+        if (++n == 4)
+        {
+            *out++ = static_cast<uint8_t>(acc >> 16);
+            *out++ = static_cast<uint8_t>(acc >> 8);
+            *out++ = static_cast<uint8_t>(acc);
+            acc = 0;
+            n = 0;
         }
     }
+    // A trailing group of n characters carries n - 1 bytes
+    if (n >= 2)
+    {
+        acc <<= 6 * (4 - n);
+        *out++ = static_cast<uint8_t>(acc >> 16);
+        if (n == 3)
+        {
+            *out++ = static_cast<uint8_t>(acc >> 8);
+        }
+    }
+    return out - start;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Encodes 12 bytes per step into 16 characters. Returns bytes consumed;
+// reads 16 bytes per step, so at least 4 bytes are left for the scalar tail.
+__attribute__((target("ssse3"))) static size_t
+base64_encode_ssse3(const uint8_t *in, size_t len, char *out, bool url_safe)
+{
+    const __m128i shift_lut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        url_safe ? '-' - 62 : '+' - 62,
+        url_safe ? '_' - 63 : '/' - 63, 'A', 0, 0);
 
-    if (i)
+    size_t i = 0;
+    for (; i + 16 <= len; i += 12)
     {
-        for (j = i; j < 3; j++)
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+
+        // Spread 3 bytes over 4 bytes, then move each 6-bit field into
+        // the low bits of its own byte.
+        v = _mm_shuffle_epi8(v, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+                                             4, 5, 3, 4, 1, 2, 0, 1));
+        __m128i t0 = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+        __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        __m128i t2 = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+        __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        __m128i idx = _mm_or_si128(t1, t3);
+
+        // Map 0..63 onto the alphabet with one table of offsets
+        __m128i r = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+        r = _mm_or_si128(r, _mm_and_si128(less, _mm_set1_epi8(13)));
+        r = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, r), idx);
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), r);
+        out += 16;
+    }
+    return i;
+}
+
+// Decodes 16 standard alphabet characters per step into 12 bytes and
+// stops at the first block holding anything else ('=', '-', '_', end of
+// data), leaving it to the scalar code. Writes 16 bytes per step.
+__attribute__((target("ssse3"))) static size_t
+base64_decode_ssse3(const uint8_t *in, size_t len, uint8_t *out, size_t *consumed)
+{
+    auto range = [](__m128i v, char lo, char hi)
+    {
+        return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                             _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), v));
+    };
+
+    size_t i = 0;
+    size_t o = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        __m128i upper = range(v, 'A', 'Z');
+        __m128i lower = range(v, 'a', 'z');
+        __m128i digit = range(v, '0', '9');
+        __m128i plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+        __m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+
+        __m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                                     _mm_or_si128(digit, _mm_or_si128(plus, slash)));
+        if (_mm_movemask_epi8(valid) != 0xffff)
         {
-            char_array_3[j] = '\0';
+            break;
         }
 
-        char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-        char_array_4[1] = ((char_array_3[0] & 0x03) << 4) +
-                          ((char_array_3[1] & 0xf0) >> 4);
-        char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) +
-                          ((char_array_3[2] & 0xc0) >> 6);
-        char_array_4[3] = char_array_3[2] & 0x3f;
+        __m128i shift = _mm_and_si128(upper, _mm_set1_epi8(-65));
+        shift = _mm_or_si128(shift, _mm_and_si128(lower, _mm_set1_epi8(-71)));
+        shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(4)));
+        shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(19)));
+        shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(16)));
+        __m128i vals = _mm_add_epi8(v, shift);
+
+        // Pack four 6-bit values into three bytes per 32-bit lane
+        __m128i ab = _mm_maddubs_epi16(vals, _mm_set1_epi32(0x01400140));
+        __m128i abcd = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+        abcd = _mm_shuffle_epi8(abcd, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                                    14, 13, 12, -1, -1, -1, -1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + o), abcd);
+        o += 12;
+    }
+    *consumed = i;
+    return o;
+}
+
+static bool cpu_has_ssse3()
+{
+    static const bool has = []
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3") != 0;
+    }();
+    return has;
+}
+#endif
+
+std::string base64_encode(const uint8_t *buf, size_t bufLen, bool url_safe)
+{
+    std::string ret((bufLen + 2) / 3 * 4, '\0');
+    char *out = &ret[0];
+    size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_ssse3())
+    {
+        done = base64_encode_ssse3(buf, bufLen, out, url_safe);
+        out += done / 3 * 4;
+    }
+#endif
+    base64_encode_scalar(buf + done, bufLen - done, out,
+                         url_safe ? base64_url : base64_std);
+    return ret;
+}
+
+std::vector<uint8_t> base64_decode(const uint8_t *in, size_t len)
+{
+    // Room for the 4 spare bytes each SIMD step stores
+    std::vector<uint8_t> ret(len / 4 * 3 + 16);
+    size_t done = 0;
+    size_t n = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (cpu_has_ssse3())
+    {
+        n = base64_decode_ssse3(in, len, ret.data(), &done);
+    }
+#endif
+    n += base64_decode_scalar(in + done, len - done, ret.data() + n);
+    ret.resize(n);
+    return ret;
+}
+
+std::vector<uint8_t> base64_decode(const std::string &encoded_string)
+{
+    return base64_decode(reinterpret_cast<const uint8_t *>(encoded_string.data()),
+                         encoded_string.size());
+}
 
-        for (j = 0; j < i + 1; j++)
+// Valid UTF-8 that needs no escaping inside a JSON string: no control
+// characters, '"' or '\\'. Blocks of plain ASCII are checked 16 or 32
+// bytes at a time; blocks holding multibyte sequences (or anything the
+// fast test rejects) are walked with the scalar decoder.
+static bool plain_ascii_block_scalar(const uint8_t *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (p[i] < 0x20 || p[i] > 0x7f || p[i] == '"' || p[i] == '\\')
         {
-            if (url_safe)
-            {
-                if (base64_chars[char_array_4[j]] == '+')
-                {
-                    ret += '-';
-                }
-                else if (base64_chars[char_array_4[j]] == '/')
-                {
-                    ret += '_';
-                }
-                else
-                {
-                    ret += base64_chars[char_array_4[j]];
-                }
-            }
-            else
-            {
-                ret += base64_chars[char_array_4[j]];
-            }
+            return false;
         }
+    }
+    return true;
+}
 
-        while (i++ < 3)
+// Scalar check of one code point at p[i]; returns its length or 0.
+static size_t plain_utf8_char(const uint8_t *p, size_t i, size_t len)
+{
+    uint8_t c = p[i];
+    if (c < 0x20 || c == '"' || c == '\\')
+    {
+        return 0; // Would break the record framing
+    }
+    size_t n;
+    if (c <= 0x7f)
+    {
+        return 1;
+    }
+    else if ((c & 0xe0) == 0xc0)
+    {
+        n = 2;
+    }
+    else if ((c & 0xf0) == 0xe0)
+    {
+        n = 3;
+    }
+    else if ((c & 0xf8) == 0xf0)
+    {
+        n = 4;
+    }
+    else
+    {
+        return 0;
+    }
+    if (i + n > len)
+    {
+        return 0;
+    }
+    for (size_t k = 1; k < n; k++)
+    {
+        if ((p[i + k] & 0xc0) != 0x80)
         {
-            if (url_safe)
-            {
-                ret += '=';
-            }
-            else
-            {
-                ret += '=';
-            }
+            return 0;
         }
     }
+    return n;
+}
 
-    return ret;
+#if defined(__x86_64__) || defined(__i386__)
+static bool plain_ascii_block_sse2(const uint8_t *p)
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    // Signed compare: bytes >= 0x80 are negative and fail "> 0x1f" too
+    __m128i ok = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f));
+    __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                               _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    return _mm_movemask_epi8(_mm_andnot_si128(bad, ok)) == 0xffff;
 }
 
-std::vector<uint8_t> base64_decode(const std::string &encoded_string)
+__attribute__((target("avx2"))) static bool plain_ascii_block_avx2(const uint8_t *p)
+{
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i ok = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1f));
+    __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                  _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_andnot_si256(bad, ok))) == 0xffffffffu;
+}
+#elif defined(__ARM_NEON)
+static bool plain_ascii_block_neon(const uint8_t *p)
 {
-    size_t in_len = encoded_string.size();
-    int i = 0;
-    int j = 0;
-    int in_ = 0;
-    uint8_t char_array_4[4], char_array_3[3];
-    std::vector<uint8_t> ret;
+    uint8x16_t v = vld1q_u8(p);
+    uint8x16_t bad = vorrq_u8(vcltq_u8(v, vdupq_n_u8(0x20)), vcgtq_u8(v, vdupq_n_u8(0x7f)));
+    bad = vorrq_u8(bad, vceqq_u8(v, vdupq_n_u8('"')));
+    bad = vorrq_u8(bad, vceqq_u8(v, vdupq_n_u8('\\')));
+    return vmaxvq_u8(bad) == 0;
+}
+#endif
+
+using PlainBlockFn = bool (*)(const uint8_t *);
 
-    auto is_base64 = [](unsigned char c)
+static void plain_block_kernel(PlainBlockFn *fn, size_t *width)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool avx2 = []
     {
-        return (isalnum(c) || (c == '+') || (c == '/') ||
-                (c == '-') || (c == '_'));
-    };
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+    *fn = avx2 ? plain_ascii_block_avx2 : plain_ascii_block_sse2;
+    *width = avx2 ? 32 : 16;
+#elif defined(__ARM_NEON)
+    *fn = plain_ascii_block_neon;
+    *width = 16;
+#else
+    *fn = nullptr;
+    *width = 0;
+#endif
+}
+
+bool IsPlainUTF8(const uint8_t *buf, size_t len)
+{
+    PlainBlockFn block = nullptr;
+    size_t width = 0;
+    plain_block_kernel(&block, &width);
 
-    while (in_len-- && (encoded_string[in_] != '=') &&
-           is_base64(encoded_string[in_]))
+    size_t i = 0;
+    while (i < len)
     {
-        char_array_4[i++] = encoded_string[in_];
-        in_++;
-        if (i == 4)
+        if (block && i + width <= len)
         {
-            for (i = 0; i < 4; i++)
+            if (block(buf + i))
+            {
+                i += width;
+                continue;
+            }
+            // Walk this block code point by code point; the last sequence
+            // may run past it.
+            size_t end = i + width;
+            while (i < end)
             {
-                size_t pos = base64_chars.find(char_array_4[i]);
-                if (pos == std::string::npos)
+                size_t n = plain_utf8_char(buf, i, len);
+                if (n == 0)
                 {
-                    // Handle URL-safe characters
-                    if (char_array_4[i] == '-')
-                    {
-                        char_array_4[i] = '+';
-                    }
-                    else if (char_array_4[i] == '_')
-                    {
-                        char_array_4[i] = '/';
-                    }
-                    else
-                    {
-                        throw std::runtime_error("invalid base64 character");
-                    }
-                    pos = base64_chars.find(char_array_4[i]);
+                    return false;
                 }
-                char_array_4[i] = static_cast<uint8_t>(pos);
+                i += n;
             }
+            continue;
+        }
 
-            char_array_3[0] = (char_array_4[0] << 2) +
-                              ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) +
-                              ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; i < 3; i++)
-            {
-                ret.push_back(char_array_3[i]);
-            }
-            i = 0;
+        if (!block && i + 8 <= len && plain_ascii_block_scalar(buf + i, 8))
+        {
+            i += 8;
+            continue;
+        }
+        size_t n = plain_utf8_char(buf, i, len);
+        if (n == 0)
+        {
+            return false;
         }
+        i += n;
     }
+    return true;
+}
 
-    if (i)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static size_t count_byte_avx2(const uint8_t *buf, size_t len,
+                                                              uint8_t byte, size_t *done)
+{
+    const __m256i needle = _mm256_set1_epi8(static_cast<char>(byte));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
     {
-        for (j = i; j < 4; j++)
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i));
+        count += __builtin_popcount(static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle))));
+    }
+    *done = i;
+    return count;
+}
+#endif
+
+size_t CountByte(const uint8_t *buf, size_t len, uint8_t byte)
+{
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool avx2 = []
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") != 0;
+    }();
+    if (avx2)
+    {
+        count = count_byte_avx2(buf, len, byte, &i);
+    }
+    const __m128i needle = _mm_set1_epi8(static_cast<char>(byte));
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t needle = vdupq_n_u8(byte);
+    for (; i + 16 <= len; i += 16)
+    {
+        // Matches are 0xff; shifting right by 7 leaves 1 per match
+        uint8x16_t eq = vshrq_n_u8(vceqq_u8(vld1q_u8(buf + i), needle), 7);
+        count += vaddvq_u8(eq);
+    }
+#endif
+    for (; i < len; i++)
+    {
+        count += buf[i] == byte;
+    }
+    return count;
+}
+
+// CRC-32C: slicing table in software, the crc32 instruction where SSE4.2
+// (x86) or the CRC extension (ARM) is available.
+struct Crc32cTable
+{
+    uint32_t t[4][256];
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; i++)
         {
-            char_array_4[j] = 0;
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c >> 1) ^ (0x82f63b78 & (0u - (c & 1)));
+            }
+            t[0][i] = c;
         }
-
-        for (j = 0; j < 4; j++)
+        for (uint32_t i = 0; i < 256; i++)
         {
-            size_t pos = base64_chars.find(char_array_4[j]);
-            if (pos == std::string::npos)
+            for (int s = 1; s < 4; s++)
             {
-                // Handle URL-safe characters
-                if (char_array_4[j] == '-')
-                {
-                    char_array_4[j] = '+';
-                }
-                else if (char_array_4[j] == '_')
-                {
-                    char_array_4[j] = '/';
-                }
-                else
-                {
-                    throw std::runtime_error("invalid base64 character");
-                }
-                pos = base64_chars.find(char_array_4[j]);
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
             }
-            char_array_4[j] = static_cast<uint8_t>(pos);
         }
+    }
+};
 
-        char_array_3[0] = (char_array_4[0] << 2) +
-                          ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) +
-                          ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+static uint32_t crc32c_scalar(uint32_t c, const uint8_t *p, size_t n)
+{
+    static const Crc32cTable table;
+    const auto &t = table.t;
+    for (; n >= 4; n -= 4, p += 4)
+    {
+        c ^= static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+             static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+        c = t[3][c & 0xff] ^ t[2][(c >> 8) & 0xff] ^ t[1][(c >> 16) & 0xff] ^ t[0][c >> 24];
+    }
+    for (; n > 0; n--, p++)
+    {
+        c = (c >> 8) ^ t[0][(c ^ *p) & 0xff];
+    }
+    return c;
+}
 
-        for (j = 0; j < i - 1; j++)
-        {
-            ret.push_back(char_array_3[j]);
-        }
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(uint32_t c, const uint8_t *p, size_t n)
+{
+    uint64_t c64 = c;
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+    }
+    c = static_cast<uint32_t>(c64);
+    for (; n > 0; n--, p++)
+    {
+        c = _mm_crc32_u8(c, *p);
+    }
+    return c;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_arm(uint32_t c, const uint8_t *p, size_t n)
+{
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        std::memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    for (; n > 0; n--, p++)
+    {
+        c = __crc32cb(c, *p);
     }
+    return c;
+}
+#endif
 
-    return ret;
+uint32_t Crc32c(const uint8_t *buf, size_t len, uint32_t crc)
+{
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool sse42 = []
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2") != 0;
+    }();
+    crc = sse42 ? crc32c_sse42(crc, buf, len) : crc32c_scalar(crc, buf, len);
+#elif defined(__ARM_FEATURE_CRC32)
+    crc = crc32c_arm(crc, buf, len);
+#else
+    crc = crc32c_scalar(crc, buf, len);
+#endif
+    return ~crc;
 }
 
 // Varint encoding/decoding functions
@@ -240,4 +587,79 @@ void WriteVarint(uint64_t value, std::vector<uint8_t> &out)
         value >>= 7;
     }
     out.push_back(static_cast<uint8_t>(value));
-}
\ No newline at end of file
+}
+
+std::string SegmentName(uint64_t index)
+{
+    std::ostringstream oss;
+    oss << std::setw(20) << std::setfill('0') << index;
+    return oss.str();
+}
+
+void SyncPath(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("failed to open for sync: " + path);
+    }
+    int rc = ::fsync(fd);
+    ::close(fd);
+    if (rc != 0)
+    {
+        throw std::runtime_error("failed to sync: " + path);
+    }
+}
+
+bool WriteFileSync(const std::string &path, const void *data, size_t size, uint32_t perms)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, perms);
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool ok = ::write(fd, data, size) == static_cast<ssize_t>(size) && ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+void RunParallel(size_t count, const std::function<void(size_t)> &fn)
+{
+    std::vector<std::exception_ptr> errors(count);
+    std::vector<std::thread> workers;
+    for (size_t w = 1; w < count; w++)
+    {
+        workers.emplace_back([&, w]()
+                             {
+            try
+            {
+                fn(w);
+            }
+            catch (...)
+            {
+                errors[w] = std::current_exception();
+            } });
+    }
+    if (count > 0)
+    {
+        try
+        {
+            fn(0);
+        }
+        catch (...)
+        {
+            errors[0] = std::current_exception();
+        }
+    }
+    for (auto &t : workers)
+    {
+        t.join();
+    }
+    for (auto &e : errors)
+    {
+        if (e)
+        {
+            std::rethrow_exception(e);
+        }
+    }
+}
@@ -1,20 +1,35 @@
 #include "wal.h"
+#include "wal_codec.h"
 #include "utils.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <sstream>
 #include <iostream>
+#include <set>
 #include <stdexcept>
 #include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
 const WAL::Options WAL::DefaultOptions{};
 
+// A blob reference record: u64 offset and u64 length in the segment's blob
+// file, then the u32 CRC-32C of the value.
+static const size_t blob_ref_size = 20;
+
 WAL::WAL(const std::string &path, const Options &options)
     : path_(fs::absolute(path).string()), options_(options)
 {
@@ -42,18 +57,142 @@ WAL::WAL(const std::string &path, const Options &options)
     }
 
     fs::create_directories(path_);
+    if (!options_.cold_dir.empty())
+    {
+        cold_path_ = fs::absolute(options_.cold_dir).string();
+        fs::create_directories(cold_path_);
+    }
 
-    this->scache_.resize(options_.segment_cache_size);
+    size_t cache_bytes = options_.block_cache_size;
+    if (cache_bytes == 0)
+    {
+        cache_bytes = options_.segment_cache_size * options_.segment_size;
+    }
+    // Every shard has to fit at least one block
+    bcache_ = std::make_unique<BlockCache>(std::max<size_t>(cache_bytes, 16 * 65536));
 
     this->load();
+
+    if (backgroundSync())
+    {
+        sync_thread_ = std::thread(&WAL::syncLoop, this);
+    }
+    if (!cold_path_.empty())
+    {
+        tier_thread_ = std::thread(&WAL::tierLoop, this);
+    }
 }
 
 WAL::~WAL()
 {
-    Close();
+    // A corrupt log is reported by an explicit Close; a destructor can't throw
+    try
+    {
+        Close();
+    }
+    catch (const std::exception &)
+    {
+    }
 }
 
 void WAL::Write(uint64_t index, const std::vector<uint8_t> &data)
+{
+    Write(index, data.data(), data.size());
+}
+
+void WAL::Write(uint64_t index, std::vector<uint8_t> &&data)
+{
+    Write(index, data.data(), data.size());
+}
+
+// Single entry fast path: the payload is encoded straight into the tail
+// segment buffer without staging it in a batch.
+void WAL::Write(uint64_t index, const uint8_t *data, size_t size)
+{
+    Write(index, data, size, EntryMeta{});
+}
+
+void WAL::Write(uint64_t index, const uint8_t *data, size_t size, const EntryMeta &meta)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (corrupt_)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+    if (closed_)
+    {
+        throw std::runtime_error("log closed");
+    }
+
+    EntryRef entry{index, data, size, meta};
+    writeEntriesInternal(&entry, 1);
+}
+
+uint8_t *WAL::Reserve(uint64_t index, size_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (corrupt_)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+    if (closed_)
+    {
+        throw std::runtime_error("log closed");
+    }
+    if (importing_)
+    {
+        throw std::runtime_error("import in progress");
+    }
+    if (index != last_index_ + reserved_.entries.size() + 1)
+    {
+        throw std::runtime_error("out of order");
+    }
+
+    if (options_.log_format == LogFormat::JSON)
+    {
+        // The encoding depends on the payload, so it is staged
+        size_t off = reserved_.datas.size();
+        reserved_.entries.push_back({index, size});
+        reserved_.datas.resize(off + size);
+        return reserved_.datas.data() + off;
+    }
+
+    if (reserved_.entries.empty())
+    {
+        if (segments_.back()->ebuf.size() > options_.segment_size)
+        {
+            cycleSegment();
+        }
+        reserved_mark_ = segments_.back()->ebuf.size();
+    }
+
+    auto &seg = *segments_.back();
+    auto &ebuf = seg.ebuf;
+    size_t pos = ebuf.size();
+    if (seg.format == LogFormat::BinaryV2)
+    {
+        if (size > UINT32_MAX)
+        {
+            throw std::runtime_error("entry too large");
+        }
+        // The CRC is filled in by Commit once the payload is written
+        ebuf.resize(pos + 12, 0);
+        uint32_t len = static_cast<uint32_t>(size);
+        std::memcpy(ebuf.data() + pos, &len, 4);
+    }
+    else
+    {
+        WriteVarint(size, ebuf);
+    }
+    size_t data_pos = ebuf.size();
+    ebuf.resize(data_pos + size);
+
+    reserved_.entries.push_back({index, size});
+    reserved_pos_.emplace_back(pos, ebuf.size());
+    return ebuf.data() + data_pos;
+}
+
+void WAL::Commit()
 {
     std::lock_guard<std::mutex> lock(mutex_);
     if (corrupt_)
@@ -64,14 +203,187 @@ void WAL::Write(uint64_t index, const std::vector<uint8_t> &data)
     {
         throw std::runtime_error("log closed");
     }
+    if (reserved_.entries.empty())
+    {
+        return;
+    }
+
+    if (options_.log_format == LogFormat::JSON)
+    {
+        Batch staged;
+        std::swap(staged, reserved_);
+        writeBatchInternal(&staged);
+        return;
+    }
+
+    // The reserved records are contiguous in the tail buffer, so they go
+    // out in a single write.
+    auto seg = segments_.back();
+    if (seg->format == LogFormat::BinaryV2)
+    {
+        for (size_t i = 0; i < reserved_pos_.size(); i++)
+        {
+            sealRecord(seg->ebuf.data() + reserved_pos_[i].first,
+                       reserved_.entries[i].index);
+        }
+    }
+    try
+    {
+        writeTail(reserved_mark_);
+    }
+    catch (...)
+    {
+        corrupt_ = true;
+        throw;
+    }
+    seg->epos.insert(seg->epos.end(), reserved_pos_.begin(), reserved_pos_.end());
+    last_index_ = reserved_.entries.back().index;
+
+    syncWritten(seg->ebuf.size() - reserved_mark_, reserved_.entries.size(), false);
 
-    wbatch_.Clear();
-    wbatch_.Write(index, data);
+    reserved_.Clear();
+    reserved_pos_.clear();
+}
 
-    writeBatchInternal(&wbatch_);
+void WAL::Abort()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!reserved_.entries.empty() && options_.log_format != LogFormat::JSON)
+    {
+        segments_.back()->ebuf.resize(reserved_mark_);
+    }
+    reserved_.Clear();
+    reserved_pos_.clear();
 }
 
 std::vector<uint8_t> WAL::Read(uint64_t index)
+{
+    for (;;)
+    {
+        ColdRead req;
+        uint64_t gen;
+        std::string blob_seg; // a tail blob to read after unlocking
+        std::vector<uint8_t> blob_ref;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (corrupt_)
+            {
+                throw std::runtime_error("log corrupt");
+            }
+            if (closed_)
+            {
+                throw std::runtime_error("log closed");
+            }
+            if (index == 0 || index < first_index_ || index > last_index_)
+            {
+                throw std::runtime_error("not found");
+            }
+            bool sequential = index == last_read_ + 1;
+            last_read_ = index;
+
+            // The tail segment is always in memory
+            auto tail = segments_.back();
+            if (index >= tail->index)
+            {
+                const auto &epos = tail->epos[index - tail->index];
+                uint32_t flags;
+                auto data = readEntry(tail->ebuf.data() + epos.first,
+                                      epos.second - epos.first, index, tail->format, &flags);
+                if (!(flags & wal_codec::blob_flag))
+                {
+                    return data;
+                }
+                blob_seg = tail->path;
+                blob_ref = std::move(data);
+            }
+
+            gen = cut_gen_.load();
+            if (blob_seg.empty())
+            {
+                auto seg = segments_[findSegment(index)];
+                if (options_.readahead && sequential)
+                {
+                    maybeReadahead(seg, index);
+                }
+                req = coldRead(seg, index);
+            }
+        }
+
+        // Blob files are append only, so the value is read unlocked
+        if (!blob_seg.empty())
+        {
+            std::vector<uint8_t> data;
+            if (readBlob(blob_seg, blob_ref, &data))
+            {
+                return data;
+            }
+            if (cut_gen_.load() != gen)
+            {
+                continue;
+            }
+            throw std::runtime_error("log corrupt");
+        }
+
+        // Sealed segments never change under their id, so their bytes are
+        // fetched through the block cache without holding the log lock.
+        std::vector<uint8_t> data;
+        bool ok;
+        try
+        {
+            ok = readCold(req, &data);
+        }
+        catch (const std::exception &)
+        {
+            if (cut_gen_.load() != gen)
+            {
+                continue; // Raced a back truncation
+            }
+            throw;
+        }
+        if (ok)
+        {
+            if (cut_gen_.load() != gen)
+            {
+                continue;
+            }
+            return data;
+        }
+
+        // The offset index is missing or unusable, or the segment went away
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_)
+        {
+            throw std::runtime_error("log closed");
+        }
+        if (index < first_index_ || index > last_index_)
+        {
+            throw std::runtime_error("not found");
+        }
+        int seg_idx = findSegment(index);
+        if (seg_idx == static_cast<int>(segments_.size()) - 1 ||
+            segments_[seg_idx]->id != req.id || segments_[seg_idx]->path != req.path)
+        {
+            continue; // Cut, or moved to the cold tier
+        }
+        rebuildSegmentIndex(seg_idx);
+        req = coldRead(segments_[seg_idx], index);
+        if (!readCold(req, &data))
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        return data;
+    }
+}
+
+WAL::EntryMeta WAL::ReadMeta(uint64_t index)
+{
+    std::vector<EntryMeta> meta = ReadMeta(index, index);
+    return meta[0];
+}
+
+// Served from the segment's meta array without decoding payloads. A sealed
+// segment not written by this process is read once, on its first lookup.
+std::vector<WAL::EntryMeta> WAL::ReadMeta(uint64_t first, uint64_t last)
 {
     std::lock_guard<std::mutex> lock(mutex_);
     if (corrupt_)
@@ -82,22 +394,33 @@ std::vector<uint8_t> WAL::Read(uint64_t index)
     {
         throw std::runtime_error("log closed");
     }
-    if (index == 0 || index < first_index_ || index > last_index_)
+    if (first == 0 || first > last || first < first_index_ || last > last_index_)
     {
         throw std::runtime_error("not found");
     }
 
-    auto s = loadSegment(index);
-    const auto &epos = s->epos[index - s->index];
-    const auto edata = std::vector<uint8_t>(
-        s->ebuf.begin() + epos.first,
-        s->ebuf.begin() + epos.second);
-
-    if (options_.log_format == LogFormat::JSON)
+    std::vector<EntryMeta> out(last - first + 1);
+    uint64_t index = first;
+    for (int i = findSegment(first); index <= last; i++)
     {
-        return readJSON(edata);
+        const auto &seg = segments_[i];
+        if (!seg->meta_loaded)
+        {
+            loadSegmentMeta(seg);
+        }
+        uint64_t seg_end = i + 1 < static_cast<int>(segments_.size())
+                               ? segments_[i + 1]->index - 1
+                               : last_index_;
+        uint64_t stop = std::min(seg_end, last);
+        // Entries past the array have no metadata
+        uint64_t have = seg->index + seg->meta.size();
+        for (; index <= stop && index < have; index++)
+        {
+            out[index - first] = seg->meta[index - seg->index];
+        }
+        index = stop + 1;
     }
-    return readBinary(edata, options_.no_copy);
+    return out;
 }
 
 uint64_t WAL::FirstIndex()
@@ -148,7 +471,6 @@ void WAL::TruncateFront(uint64_t index)
         throw std::runtime_error("log closed");
     }
     truncateFrontInternal(index);
-    std::cout << "segments size after truncate: " << segments_.size() << std::endl;
 }
 
 void WAL::TruncateBack(uint64_t index)
@@ -163,7 +485,6 @@ void WAL::TruncateBack(uint64_t index)
         throw std::runtime_error("log closed");
     }
     truncateBackInternal(index);
-    std::cout << "segments size after truncate: " << segments_.size() << std::endl;
 }
 
 void WAL::Sync()
@@ -177,53 +498,68 @@ void WAL::Sync()
     {
         throw std::runtime_error("log closed");
     }
-    if (sfile_)
+    if (!sfile_->flush())
     {
-
-        sfile_->flush();
-
-        if (!options_.no_sync)
-        {
-            // 保存当前路径
-            std::string current_path = segments_.back()->path;
-
-            // 关闭并重新打开文件以确保同步
-            sfile_->close();
-            sfile_->open(current_path,
-                         std::ios::binary | std::ios::out | std::ios::in);
-            sfile_->seekp(0, std::ios::end);
-        }
+        corrupt_ = true;
+        throw std::runtime_error("failed to write to segment file");
     }
-}
-
-void WAL::Close()
-{
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (closed_)
+    // With no_sync, segments sealed since the last Sync are still unsynced.
+    // One already deleted needs no sync.
+    std::vector<std::string> unsynced;
+    unsynced.swap(unsynced_segments_);
+    for (const auto &path : unsynced)
     {
-        if (corrupt_)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0 && errno == ENOENT)
         {
-            throw std::runtime_error("log corrupt");
+            continue;
+        }
+        bool ok = fd >= 0 && ::fsync(fd) == 0;
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        if (!ok)
+        {
+            corrupt_ = true;
+            throw std::runtime_error("failed to sync segment file");
         }
-        return;
     }
-
-    if (sfile_)
+    try
     {
-
-        // Sync();
-        sfile_->flush();
-        sfile_->close();
+        syncBlob();
     }
-    closed_ = true;
-    if (corrupt_)
+    catch (...)
     {
-        throw std::runtime_error("log corrupt");
+        corrupt_ = true;
+        throw;
+    }
+    if (::fdatasync(sync_fd_) != 0)
+    {
+        corrupt_ = true;
+        throw std::runtime_error("failed to sync segment file");
+    }
+    durable_index_ = last_index_;
+    unsynced_bytes_ = 0;
+    unsynced_entries_ = 0;
+    if (asyncReady())
+    {
+        sync_cv_.notify_one();
     }
 }
 
-void WAL::ClearCache()
+// Drops a removed segment and its blob file from the no_sync backlog
+void WAL::forgetUnsynced(const std::string &segment_path)
+{
+    std::string blob = blobPath(segment_path);
+    unsynced_segments_.erase(
+        std::remove_if(unsynced_segments_.begin(), unsynced_segments_.end(),
+                       [&](const std::string &p)
+                       { return p == segment_path || p == blob; }),
+        unsynced_segments_.end());
+}
+
+uint64_t WAL::DurableIndex()
 {
     std::lock_guard<std::mutex> lock(mutex_);
     if (corrupt_)
@@ -234,77 +570,287 @@ void WAL::ClearCache()
     {
         throw std::runtime_error("log closed");
     }
-    clearCacheInternal();
+    return durable_index_;
 }
 
-// Private methods
-void WAL::load()
+// The segment list and the tail's written length are taken under the lock;
+// sealed segments are then hard linked and the tail prefix copied without
+// it. A copy that raced a back truncation is redone.
+void WAL::Checkpoint(const std::string &dir)
 {
-    // 直接使用成员变量 segments_ 替代局部变量 segments
-    segments_.clear();
-
-    int start_idx = -1;
-    int end_idx = -1;
+    fs::path dst = fs::absolute(dir);
+    if (fs::exists(dst) && !fs::is_empty(dst))
+    {
+        throw std::runtime_error("checkpoint directory not empty");
+    }
 
-    // 1. 扫描目录并收集段文件
-    for (const auto &entry : fs::directory_iterator(path_))
+    struct Source
     {
-        if (!entry.is_regular_file())
-            continue;
+        std::string path;
+        uint64_t index;
+    };
 
-        std::string name = entry.path().filename().string();
-        if (name.size() < 20)
-            continue;
+    for (int attempt = 0;; attempt++)
+    {
+        std::vector<Source> sealed;
+        Source tail;
+        uint64_t tail_len;
+        uint64_t tail_blob_len = 0;
+        uint64_t first;
+        uint64_t gen;
 
-        uint64_t index;
-        try
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (corrupt_)
         {
-            index = std::stoull(name.substr(0, 20));
+            throw std::runtime_error("log corrupt");
         }
-        catch (...)
+        if (closed_)
         {
-            continue;
+            throw std::runtime_error("log closed");
+        }
+        if (!sfile_->flush())
+        {
+            throw std::runtime_error("failed to write to segment file");
+        }
+        first = first_index_;
+        for (size_t i = 0; i + 1 < segments_.size(); i++)
+        {
+            sealed.push_back({segments_[i]->path, segments_[i]->index});
+        }
+        auto seg = segments_.back();
+        tail = {seg->path, seg->index};
+        // Reserved binary entries sit in the tail buffer but are not written
+        bool reserved = !reserved_.entries.empty() && options_.log_format != LogFormat::JSON;
+        tail_len = reserved ? reserved_mark_ : seg->ebuf.size();
+        struct stat st;
+        if (blob_fd_ >= 0)
+        {
+            tail_blob_len = blob_size_;
+        }
+        else if (::stat(blobPath(seg->path).c_str(), &st) == 0)
+        {
+            tail_blob_len = st.st_size;
+        }
+        gen = cut_gen_.load();
+        bool locked = attempt >= 3;
+        if (!locked)
+        {
+            lock.unlock();
         }
 
-        if (index == 0)
-            continue;
-
-        bool is_start = (name.size() == 26) && (name.substr(20) == ".START");
-        bool is_end = (name.size() == 24) && (name.substr(20) == ".END");
+        fs::remove_all(dst);
+        fs::create_directories(dst);
+        fs::permissions(dst, static_cast<fs::perms>(options_.dir_perms));
 
-        if (name.size() == 20 || is_start || is_end)
+        // False if `from` does not exist (any more)
+        auto linkOrCopy = [](const std::string &from, const fs::path &to)
         {
-            auto seg = std::make_shared<Segment>();
-            seg->index = index;
-            seg->path = entry.path().string();
-
-            if (is_start)
+            if (::link(from.c_str(), to.c_str()) == 0)
             {
-                start_idx = segments_.size();
+                return true;
             }
-            else if (is_end && end_idx == -1)
+            if (errno == ENOENT)
             {
-                end_idx = segments_.size();
+                return false;
+            }
+            // Another filesystem: copy instead
+            std::error_code ec;
+            fs::copy_file(from, to, ec);
+            if (ec == std::errc::no_such_file_or_directory)
+            {
+                return false;
+            }
+            if (ec)
+            {
+                throw std::runtime_error("failed to checkpoint segment");
             }
+            SyncPath(to.string());
+            return true;
+        };
 
-            segments_.push_back(seg);
+        bool ok = true;
+        for (const auto &src : sealed)
+        {
+            fs::path to = dst / segmentName(src.index);
+            if (!linkOrCopy(src.path, to))
+            {
+                ok = false; // Removed by a front truncation meanwhile
+                break;
+            }
+            if (!linkOrCopy(blobPath(src.path), blobPath(to.string())) &&
+                !fs::exists(src.path))
+            {
+                ok = false;
+                break;
+            }
+        }
+
+        if (ok)
+        {
+            std::ifstream in(tail.path, std::ios::binary);
+            std::vector<char> buf(tail_len);
+            ok = in && in.read(buf.data(), buf.size());
+            if (ok && !WriteFileSync(dst / segmentName(tail.index), buf.data(), buf.size(),
+                                     options_.file_perms))
+            {
+                throw std::runtime_error("failed to checkpoint tail segment");
+            }
+        }
+        if (ok && tail_blob_len > 0)
+        {
+            std::ifstream in(blobPath(tail.path), std::ios::binary);
+            std::vector<char> buf(tail_blob_len);
+            ok = in && in.read(buf.data(), buf.size());
+            if (ok && !WriteFileSync(blobPath((dst / segmentName(tail.index)).string()),
+                                     buf.data(), buf.size(), options_.file_perms))
+            {
+                throw std::runtime_error("failed to checkpoint tail segment");
+            }
+        }
+
+        if (ok)
+        {
+            std::string snap = "WAL-MANIFEST 1\n";
+            for (const auto &src : sealed)
+            {
+                snap += "add=" + std::to_string(src.index) + " ";
+            }
+            snap += "add=" + std::to_string(tail.index) + " ";
+            snap += "front=" + std::to_string(first) + "\n";
+            if (!WriteFileSync(dst / "MANIFEST", snap.data(), snap.size(), options_.file_perms))
+            {
+                throw std::runtime_error("failed to write manifest");
+            }
+            SyncPath(dst.string());
+        }
+
+        if (ok && (locked || cut_gen_.load() == gen))
+        {
+            return;
+        }
+        if (locked)
+        {
+            throw std::runtime_error("failed to checkpoint");
         }
     }
+}
 
-    // 2. 排序段文件
-    std::sort(segments_.begin(), segments_.end(),
-              [](const auto &a, const auto &b)
-              { return a->index < b->index; });
+void WAL::Close()
+{
+    // The sync thread takes mutex_, so it is stopped before the lock is
+    // held; whatever it had not synced yet is synced below.
+    stopReadahead();
+    stopSync();
+    stopTiering();
+
+    std::vector<AsyncWrite> writes;
+    bool corrupt;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_)
+        {
+            if (corrupt_)
+            {
+                throw std::runtime_error("log corrupt");
+            }
+            return;
+        }
+
+        if (sfile_)
+        {
+            sfile_->flush();
+            try
+            {
+                unmapTail();
+            }
+            catch (const std::exception &)
+            {
+                corrupt_ = true;
+            }
+            if (!options_.no_sync && !corrupt_)
+            {
+                if ((!blob_dirty_ || ::fdatasync(blob_fd_) == 0) &&
+                    ::fdatasync(sync_fd_) == 0)
+                {
+                    durable_index_ = last_index_;
+                }
+                else
+                {
+                    corrupt_ = true;
+                }
+            }
+            sfile_->close();
+        }
+        if (sync_fd_ >= 0)
+        {
+            ::close(sync_fd_);
+            sync_fd_ = -1;
+        }
+        closeBlob();
+        if (manifest_fd_ >= 0)
+        {
+            ::close(manifest_fd_);
+            manifest_fd_ = -1;
+        }
+        closed_ = true;
+        corrupt = corrupt_;
+        writes = takeAsyncWrites("log closed");
+    }
+    completeAsyncWrites(writes);
+    if (corrupt)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+}
+
+void WAL::ClearCache()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (corrupt_)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+    if (closed_)
+    {
+        throw std::runtime_error("log closed");
+    }
+    clearCacheInternal();
+}
+
+// Private methods
+void WAL::load()
+{
+    // 直接使用成员变量 segments_ 替代局部变量 segments
+    segments_.clear();
+    first_index_ = 0;
+    manifest_edits_ = 0;
+    manifest_back_ = 0;
+
+    // 1. Read the segment set from the manifest; directories written before
+    // it existed are scanned once and migrated.
+    bool migrate = !fs::exists(fs::path(path_) / "MANIFEST");
+    if (migrate)
+    {
+        scanSegments();
+    }
+    else
+    {
+        readManifest();
+    }
+    resolveTiers();
+    indexSegments();
 
-    // 3. 处理空日志情况
+    // 2. 处理空日志情况
     if (segments_.empty())
     {
+        // A manifest that lists no segment still knows where the log starts
         auto seg = std::make_shared<Segment>();
-        seg->index = 1;
-        seg->path = (fs::path(path_) / segmentName(1)).string();
+        seg->index = std::max<uint64_t>(first_index_, 1);
+        seg->path = (fs::path(path_) / segmentName(seg->index)).string();
         segments_.push_back(seg);
-        first_index_ = 1;
-        last_index_ = 0;
+        first_index_ = seg->index;
+        last_index_ = seg->index - 1;
+        indexSegments();
 
         sfile_ = std::make_unique<std::fstream>(
             seg->path,
@@ -314,10 +860,148 @@ void WAL::load()
             segments_.clear(); // 清理已添加的segment
             throw std::runtime_error("failed to create segment file");
         }
+        initSegment(*seg, *sfile_);
+        openSyncFd();
+        writeManifest();
         return;
     }
 
-    // 4. 处理START/END段
+    if (first_index_ < segments_[0]->index)
+    {
+        first_index_ = segments_[0]->index;
+    }
+    // A pending back bound survives until the tail is cut below
+    if (migrate || (manifest_edits_ >= options_.manifest_compact_edits && manifest_back_ == 0))
+    {
+        writeManifest();
+    }
+
+    // 3. 初始化最后段
+    auto last_seg = segments_.back();
+    if (!fs::exists(last_seg->path))
+    {
+        // The tail is created before its add edit is logged, but tolerate
+        // a filesystem that lost the empty file.
+        std::ofstream(last_seg->path, std::ios::binary);
+    }
+    trimPreallocated(last_seg->path, last_seg->index);
+
+    sfile_ = std::make_unique<std::fstream>(
+        last_seg->path,
+        std::ios::binary | std::ios::out | std::ios::in);
+    if (!*sfile_)
+    {
+        segments_.clear();
+        throw std::runtime_error("failed to open segment file");
+    }
+
+    sfile_->seekp(0, std::ios::end);
+    loadSegmentEntries(last_seg);
+    if (manifest_back_ >= last_seg->index &&
+        manifest_back_ - last_seg->index + 1 < last_seg->epos.size())
+    {
+        // A back truncation was logged but its cut did not reach the file
+        size_t count = manifest_back_ - last_seg->index + 1;
+        size_t boundary = last_seg->epos[count - 1].second;
+        sfile_->close();
+        fs::resize_file(last_seg->path, boundary);
+        last_seg->ebuf.resize(boundary);
+        last_seg->epos.resize(count);
+        if (last_seg->meta.size() > count)
+        {
+            last_seg->meta.resize(count);
+        }
+        sfile_->open(last_seg->path, std::ios::binary | std::ios::out | std::ios::in);
+        if (!*sfile_)
+        {
+            segments_.clear();
+            throw std::runtime_error("failed to open segment file");
+        }
+        sfile_->seekp(0, std::ios::end);
+    }
+    if (last_seg->ebuf.empty())
+    {
+        // Nothing written yet, so the tail can take the configured format
+        initSegment(*last_seg, *sfile_);
+    }
+    last_index_ = last_seg->index + last_seg->epos.size() - 1;
+    if (last_index_ < first_index_ - 1)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+    openSyncFd();
+    durable_index_ = last_index_;
+    if (manifest_back_ != 0)
+    {
+        if (!options_.no_sync && ::fdatasync(sync_fd_) != 0)
+        {
+            throw std::runtime_error("failed to sync segment file");
+        }
+        writeManifest();
+    }
+
+    if (options_.verify_on_open)
+    {
+        verifySegments();
+    }
+}
+
+void WAL::scanSegments()
+{
+    int start_idx = -1;
+    int end_idx = -1;
+
+    // 1. 扫描目录并收集段文件
+    for (const auto &entry : fs::directory_iterator(path_))
+    {
+        if (!entry.is_regular_file())
+            continue;
+
+        std::string name = entry.path().filename().string();
+        if (name.size() < 20)
+            continue;
+
+        uint64_t index;
+        try
+        {
+            index = std::stoull(name.substr(0, 20));
+        }
+        catch (...)
+        {
+            continue;
+        }
+
+        if (index == 0)
+            continue;
+
+        bool is_start = (name.size() == 26) && (name.substr(20) == ".START");
+        bool is_end = (name.size() == 24) && (name.substr(20) == ".END");
+
+        if (name.size() == 20 || is_start || is_end)
+        {
+            auto seg = std::make_shared<Segment>();
+            seg->index = index;
+            seg->path = entry.path().string();
+
+            if (is_start)
+            {
+                start_idx = segments_.size();
+            }
+            else if (is_end && end_idx == -1)
+            {
+                end_idx = segments_.size();
+            }
+
+            segments_.push_back(seg);
+        }
+    }
+
+    // 2. 排序段文件
+    std::sort(segments_.begin(), segments_.end(),
+              [](const auto &a, const auto &b)
+              { return a->index < b->index; });
+
+    // 3. 处理START/END段
     try
     {
         if (start_idx != -1)
@@ -377,164 +1061,550 @@ void WAL::load()
         throw;
     }
 
-    // 5. 初始化最后段
-    first_index_ = segments_[0]->index;
-    auto last_seg = segments_.back();
-
-    sfile_ = std::make_unique<std::fstream>(
-        last_seg->path,
-        std::ios::binary | std::ios::out | std::ios::in);
-    if (!*sfile_)
-    {
-        segments_.clear();
-        throw std::runtime_error("failed to open segment file");
-    }
+    first_index_ = segments_.empty() ? 0 : segments_[0]->index;
 
-    sfile_->seekp(0, std::ios::end);
-    loadSegmentEntries(last_seg);
-    last_index_ = last_seg->index + last_seg->epos.size() - 1;
+    // Leftover of an interrupted legacy truncation
+    std::error_code ec;
+    fs::remove(fs::path(path_) / "TEMP", ec);
 }
 
-void WAL::loadSegmentEntries(std::shared_ptr<Segment> segment)
+// The manifest is a header line and then one edit per line: `add=`, `del=`,
+// `front=` and `back=` operations applied together. `back` bounds the tail
+// until `back=0` or the next snapshot. A last line without its newline is
+// ignored.
+void WAL::readManifest()
 {
-    std::ifstream file(segment->path, std::ios::binary | std::ios::ate);
+    std::ifstream file(fs::path(path_) / "MANIFEST", std::ios::binary);
     if (!file)
     {
-        throw std::runtime_error("failed to open segment file for reading");
+        throw std::runtime_error("failed to open manifest");
     }
+    std::string content((std::istreambuf_iterator<char>(file)),
+                        std::istreambuf_iterator<char>());
 
-    size_t size = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    segment->ebuf.resize(size);
-    if (!file.read(reinterpret_cast<char *>(segment->ebuf.data()), size))
-    {
-        throw std::runtime_error("failed to read segment file");
-    }
+    std::set<uint64_t> live;
+    std::set<uint64_t> removed;
+    uint64_t front = 0;
 
-    segment->epos.clear();
     size_t pos = 0;
-    uint64_t exidx = segment->index;
-
-    while (pos < segment->ebuf.size())
+    bool header = true;
+    while (pos < content.size())
     {
-        size_t n = 0;
-        if (options_.log_format == LogFormat::JSON)
+        size_t nl = content.find('\n', pos);
+        if (nl == std::string::npos)
+        {
+            break; // torn append
+        }
+        std::string line = content.substr(pos, nl - pos);
+        pos = nl + 1;
+
+        if (header)
         {
-            // Find next newline
-            auto nl_pos = std::find(
-                segment->ebuf.begin() + pos,
-                segment->ebuf.end(),
-                '\n');
-            if (nl_pos == segment->ebuf.end())
+            if (line != "WAL-MANIFEST 1")
             {
-                throw std::runtime_error("log corrupt");
+                throw std::runtime_error("log corrupt: bad manifest header");
             }
-            n = std::distance(segment->ebuf.begin() + pos, nl_pos) + 1;
+            header = false;
+            continue;
         }
-        else
+
+        std::istringstream ops(line);
+        std::string op;
+        while (ops >> op)
         {
-            // Binary format
-            uint64_t data_size;
-            size_t varint_len = ReadVarint(
-                segment->ebuf.data() + pos,
-                segment->ebuf.size() - pos,
-                &data_size);
-            if (varint_len == 0)
+            size_t eq = op.find('=');
+            if (eq == std::string::npos)
             {
-                throw std::runtime_error("log corrupt");
+                throw std::runtime_error("log corrupt: bad manifest edit");
             }
-            if (segment->ebuf.size() - pos - varint_len < data_size)
+            uint64_t index = std::stoull(op.substr(eq + 1));
+            std::string kind = op.substr(0, eq);
+            if (kind == "add")
             {
-                throw std::runtime_error("log corrupt");
+                live.insert(index);
+                removed.erase(index);
+                manifest_back_ = 0;
+            }
+            else if (kind == "del")
+            {
+                live.erase(index);
+                removed.insert(index);
+            }
+            else if (kind == "front")
+            {
+                front = index;
+            }
+            else if (kind == "back")
+            {
+                manifest_back_ = index;
+            }
+            else
+            {
+                throw std::runtime_error("log corrupt: bad manifest edit");
             }
-            n = varint_len + data_size;
         }
-
-        segment->epos.emplace_back(pos, pos + n);
-        pos += n;
-        exidx++;
+        manifest_edits_++;
     }
-    std::cout << "LoadSegmentEntries" << std::endl;
-    for (const auto &entry : segment->epos)
+
+    // Finish deletions that a crash interrupted after their edit was logged
+    for (uint64_t index : removed)
     {
-        std::cout << "(" << entry.first << ", " << entry.second << "), ";
+        std::error_code ec;
+        fs::remove(fs::path(path_) / segmentName(index), ec);
+        fs::remove(indexPath((fs::path(path_) / segmentName(index)).string()), ec);
+        fs::remove(blobPath((fs::path(path_) / segmentName(index)).string()), ec);
+        fs::remove(preallocPath((fs::path(path_) / segmentName(index)).string()), ec);
+        if (!cold_path_.empty())
+        {
+            fs::remove(fs::path(cold_path_) / segmentName(index), ec);
+            fs::remove(indexPath((fs::path(cold_path_) / segmentName(index)).string()), ec);
+            fs::remove(blobPath((fs::path(cold_path_) / segmentName(index)).string()), ec);
+        }
     }
-    std::cout << "]" << std::endl;
-}
-
-// int WAL::findSegment(uint64_t index) const
-// {
-//     int low = 0;
-//     int high = segments_.size() - 1;
-//     int result = -1;
-
-//     while (low <= high)
-//     {
-//         std::cout << "low: " << low << ", high: " << high << std::endl;
-//         int mid = low + (high - low) / 2;
-//         if (index >= segments_[mid]->index)
-//         {
-//             result = mid;
-//             low = mid + 1;
-//         }
-//         else
-//         {
-//             high = mid - 1;
-//         }
-//     }
-
-//     return result;
-// }
 
-int WAL::findSegment(uint64_t index) const
-{
-    int low = 0;
-    int high = segments_.size();
-    std::cout << "Finding segment for index: " << index << " low: " << low << " high: " << high << std::endl;
-
-    while (low < high)
+    // Segment files past the last listed one were moved in by an import
+    // whose add edit never made it; like its staging directory, they are
+    // not part of the log
+    for (const auto &entry : fs::directory_iterator(path_))
     {
-        int mid = low + (high - low) / 2;
-        std::cout << "low: " << low << ", high: " << high << ", index: " << segments_[mid]->index << std::endl;
-        if (index >= segments_[mid]->index)
+        std::string name = entry.path().filename().string();
+        if (name.size() != 20 ||
+            !std::all_of(name.begin(), name.end(), [](unsigned char c)
+                         { return std::isdigit(c) != 0; }))
         {
-            low = mid + 1;
+            continue;
         }
-        else
+        uint64_t index = std::stoull(name);
+        if (live.count(index) == 0 && (live.empty() || index > *live.rbegin()))
         {
-            high = mid;
+            std::error_code ec;
+            fs::remove(entry.path(), ec);
+            fs::remove(indexPath(entry.path().string()), ec);
+            fs::remove(blobPath(entry.path().string()), ec);
         }
     }
-
-    return low - 1; // 返回最后一个满足条件的索引
+    {
+        std::error_code ec;
+        fs::remove_all(fs::path(path_) / "import.tmp", ec);
+    }
+
+    for (uint64_t index : live)
+    {
+        auto seg = std::make_shared<Segment>();
+        seg->index = index;
+        seg->path = (fs::path(path_) / segmentName(index)).string();
+        segments_.push_back(seg);
+    }
+    first_index_ = front;
 }
 
-std::shared_ptr<WAL::Segment> WAL::loadSegment(uint64_t index)
+// Replace the manifest with a single edit describing the current segment set.
+void WAL::writeManifest()
 {
-    // Check last segment first
-    auto last_seg = segments_.back();
-    if (index >= last_seg->index)
+    std::string snap = "WAL-MANIFEST 1\n";
+    for (const auto &seg : segments_)
     {
-        return last_seg;
+        snap += "add=" + std::to_string(seg->index) + " ";
+    }
+    snap += "front=" + std::to_string(first_index_) + "\n";
+
+    fs::path tmp_path = fs::path(path_) / "MANIFEST.tmp";
+    fs::path manifest_path = fs::path(path_) / "MANIFEST";
+
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, options_.file_perms);
+    if (fd < 0)
+    {
+        throw std::runtime_error("failed to create manifest");
+    }
+    bool ok = ::write(fd, snap.data(), snap.size()) == static_cast<ssize_t>(snap.size()) &&
+              ::fsync(fd) == 0;
+    ::close(fd);
+    if (!ok)
+    {
+        throw std::runtime_error("failed to write manifest");
+    }
+    fs::rename(tmp_path, manifest_path);
+    SyncPath(path_);
+
+    if (manifest_fd_ >= 0)
+    {
+        ::close(manifest_fd_);
+    }
+    manifest_fd_ = ::open(manifest_path.c_str(), O_WRONLY | O_APPEND);
+    if (manifest_fd_ < 0)
+    {
+        throw std::runtime_error("failed to open manifest");
+    }
+    manifest_edits_ = 0;
+    manifest_back_ = 0;
+}
+
+void WAL::appendManifest(const std::string &edit)
+{
+    if (manifest_fd_ < 0)
+    {
+        manifest_fd_ = ::open((fs::path(path_) / "MANIFEST").c_str(), O_WRONLY | O_APPEND);
+        if (manifest_fd_ < 0)
+        {
+            throw std::runtime_error("failed to open manifest");
+        }
+    }
+
+    // Compact before appending so the snapshot reflects every applied edit
+    if (manifest_edits_ >= options_.manifest_compact_edits)
+    {
+        writeManifest();
+    }
+
+    std::string line = edit + "\n";
+    if (::write(manifest_fd_, line.data(), line.size()) != static_cast<ssize_t>(line.size()))
+    {
+        throw std::runtime_error("failed to append manifest");
+    }
+    if (!options_.no_sync && ::fsync(manifest_fd_) != 0)
+    {
+        throw std::runtime_error("failed to sync manifest");
+    }
+    manifest_edits_++;
+}
+
+void WAL::loadSegmentEntries(std::shared_ptr<Segment> segment, size_t max_entries)
+{
+    std::ifstream file(segment->path, std::ios::binary | std::ios::ate);
+    if (!file)
+    {
+        throw std::runtime_error("failed to open segment file for reading");
+    }
+
+    size_t size = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    segment->ebuf.resize(size);
+    if (!file.read(reinterpret_cast<char *>(segment->ebuf.data()), size))
+    {
+        throw std::runtime_error("failed to read segment file");
     }
 
-    // Check the most recent cached segment
-    std::shared_ptr<Segment> found_seg = nullptr;
-    scache_.for_each([index, &found_seg](int seg_idx, const std::shared_ptr<Segment> &seg)
-                     {
-                         (void)seg_idx;
-                         if (seg->index <= index && index < seg->index + seg->epos.size())
+    segment->format = detectFormat(segment->ebuf, segment->index, options_.log_format);
+
+    // Offsets kept in memory, when the index could not be written, are reused
+    if (segment->epos.empty() || segment->epos.back().second > size)
+    {
+        segment->epos.clear();
+        if (!scanEntries(segment->ebuf, segment->format, max_entries, segment->epos))
+        {
+            throw std::runtime_error("log corrupt");
+        }
+    }
+
+    // A sealed segment may hold bytes past its last entry if a crash
+    // interrupted a back truncation; they are not part of the log.
+    segment->ebuf.resize(segment->epos.empty() ? segmentHeaderSize(segment->format)
+                                               : segment->epos.back().second);
+
+    segment->meta.clear();
+    wal_codec::WithCodec(segment->format, [&](auto codec)
                          {
-                             found_seg = seg; // 通过引用捕获存储结果
-                             return false;    // 终止遍历
-                         }
-                         return true; // 继续遍历
-                     });
+        using Codec = decltype(codec);
+        for (size_t e = 0; e < segment->epos.size(); e++)
+        {
+            const auto &pos = segment->epos[e];
+            EntryMeta meta;
+            if (Codec::DecodeMeta(segment->ebuf.data() + pos.first, pos.second - pos.first,
+                                  &meta))
+            {
+                segment->meta.resize(e);
+                segment->meta.push_back(meta);
+            }
+        } });
+    segment->meta_loaded = true;
+}
+
+// Fills in the metadata of a sealed segment, which otherwise stays on disk
+void WAL::loadSegmentMeta(const std::shared_ptr<Segment> &seg)
+{
+    if (seg == segments_.back())
+    {
+        seg->meta_loaded = true; // the tail's is kept as it is written
+        return;
+    }
+    bool had_epos = !seg->epos.empty();
+    int i = findSegment(seg->index);
+    loadSegmentEntries(seg, segments_[i + 1]->index - seg->index);
+    seg->ebuf = std::vector<uint8_t>();
+    if (!had_epos)
+    {
+        seg->epos = std::vector<std::pair<size_t, size_t>>();
+    }
+}
+
+// A mapped tail is preallocated with zeros, which stay in the file if the
+// process stops before the tail is trimmed. mapTail leaves a marker next to
+// such a tail; the file is cut after the last record that decodes.
+void WAL::trimPreallocated(const std::string &path, uint64_t index) const
+{
+    std::string marker = preallocPath(path);
+    if (!fs::exists(marker))
+    {
+        return;
+    }
+    int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0)
+    {
+        throw std::runtime_error("failed to open segment file");
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("failed to read segment file");
+    }
+    std::vector<uint8_t> buf(st.st_size);
+    size_t got = 0;
+    while (got < buf.size())
+    {
+        ssize_t n = ::pread(fd, buf.data() + got, buf.size() - got, got);
+        if (n <= 0)
+        {
+            ::close(fd);
+            throw std::runtime_error("failed to read segment file");
+        }
+        got += n;
+    }
+
+    LogFormat format = detectFormat(buf, index, options_.log_format);
+    std::vector<std::pair<size_t, size_t>> epos;
+    scanEntries(buf, format, SIZE_MAX, epos); // stops at a torn record
+    size_t end = std::min(segmentHeaderSize(format), buf.size());
+    for (size_t e = 0; e < epos.size(); e++)
+    {
+        uint32_t flags = 0;
+        try
+        {
+            readEntry(buf.data() + epos[e].first, epos[e].second - epos[e].first,
+                      index + e, format, &flags);
+        }
+        catch (const std::runtime_error &)
+        {
+            break; // the zeros start here
+        }
+        end = epos[e].second;
+    }
+
+    bool ok = ::ftruncate(fd, static_cast<off_t>(end)) == 0 &&
+              (options_.no_sync || ::fdatasync(fd) == 0);
+    ::close(fd);
+    if (!ok)
+    {
+        throw std::runtime_error("failed to trim segment file");
+    }
+    fs::remove(marker);
+}
+
+bool WAL::scanEntries(const std::vector<uint8_t> &buf, LogFormat format,
+                      size_t max_entries,
+                      std::vector<std::pair<size_t, size_t>> &epos)
+{
+    return wal_codec::WithCodec(format, [&](auto codec)
+                                { return decltype(codec)::Scan(buf.data(), buf.size(),
+                                                               max_entries, epos); });
+}
+
+// Decodes every record of every segment on a few threads and checks that
+// blob references fit in their blob file. Sealed segments must end right
+// before the next one starts. The first bad index is reported.
+void WAL::verifySegments()
+{
+    size_t nthreads = options_.verify_threads;
+    if (nthreads == 0)
+    {
+        nthreads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    nthreads = std::min(nthreads, segments_.size());
+
+    std::vector<uint64_t> bad(segments_.size(), 0); // 0 means the segment is intact
+    std::atomic<size_t> next{0};
+
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < segments_.size(); i = next++)
+        {
+            auto seg = segments_[i];
+            bool tail = i + 1 == segments_.size();
+            size_t limit = tail ? SIZE_MAX : segments_[i + 1]->index - seg->index;
+
+            std::vector<uint8_t> buf;
+            std::ifstream file(seg->path, std::ios::binary | std::ios::ate);
+            if (!file)
+            {
+                bad[i] = seg->index;
+                continue;
+            }
+            buf.resize(file.tellg());
+            file.seekg(0, std::ios::beg);
+            if (!file.read(reinterpret_cast<char *>(buf.data()), buf.size()))
+            {
+                bad[i] = seg->index;
+                continue;
+            }
+
+            std::vector<std::pair<size_t, size_t>> epos;
+            LogFormat format = detectFormat(buf, seg->index, options_.log_format);
+            bool ok = scanEntries(buf, format, limit, epos);
+            int64_t blob_size = -1; // stat'ed on the first reference
+
+            size_t valid = 0;
+            for (; valid < epos.size(); valid++)
+            {
+                const uint8_t *edata = buf.data() + epos[valid].first;
+                size_t esize = epos[valid].second - epos[valid].first;
+                try
+                {
+                    if (format == LogFormat::JSON)
+                    {
+                        std::string prefix = "{\"index\":\"" +
+                                             std::to_string(seg->index + valid) + "\"";
+                        if (esize < prefix.size() ||
+                            !std::equal(prefix.begin(), prefix.end(), edata))
+                        {
+                            break;
+                        }
+                    }
+                    uint32_t flags;
+                    std::vector<uint8_t> data =
+                        readEntry(edata, esize, seg->index + valid, format, &flags);
+                    if (flags & wal_codec::blob_flag)
+                    {
+                        // A reference past the end of the blob file was torn
+                        // by a crash
+                        if (blob_size < 0)
+                        {
+                            struct stat st;
+                            blob_size = ::stat(blobPath(seg->path).c_str(), &st) == 0
+                                            ? st.st_size
+                                            : 0;
+                        }
+                        uint64_t offset;
+                        uint64_t len;
+                        if (data.size() != blob_ref_size)
+                        {
+                            break;
+                        }
+                        std::memcpy(&offset, data.data(), 8);
+                        std::memcpy(&len, data.data() + 8, 8);
+                        if (offset > static_cast<uint64_t>(blob_size) ||
+                            len > static_cast<uint64_t>(blob_size) - offset)
+                        {
+                            break;
+                        }
+                    }
+                }
+                catch (const std::exception &)
+                {
+                    break;
+                }
+            }
 
-    if (found_seg)
+            if (!ok || valid < epos.size() || (!tail && epos.size() < limit))
+            {
+                bad[i] = seg->index + valid;
+            }
+            else if (!tail)
+            {
+                // The offsets are not kept: reads go through the offset
+                // index, which is written here if it is missing
+                seg->format = format;
+                if (!fs::exists(indexPath(seg->path)))
+                {
+                    Segment scanned;
+                    scanned.path = seg->path;
+                    scanned.format = format;
+                    scanned.epos = std::move(epos);
+                    writeSegmentIndex(scanned);
+                }
+            }
+        }
+    };
+
+    RunParallel(nthreads, [&](size_t)
+                { worker(); });
+
+    for (size_t i = 0; i < bad.size(); i++)
+    {
+        if (bad[i] != 0)
+        {
+            throw std::runtime_error("log corrupt: first bad index " + std::to_string(bad[i]));
+        }
+    }
+}
+
+// Position in segments_ of the segment holding `index`, or -1 if it is
+// before the first. Tries the last hit, then searches the Eytzinger array.
+int WAL::findSegment(uint64_t index) const
+{
+    size_t n = seg_starts_.size();
+    size_t hint = seg_hint_;
+    if (hint < n && seg_starts_[hint] <= index &&
+        (hint + 1 == n || index < seg_starts_[hint + 1]))
+    {
+        return static_cast<int>(hint);
+    }
+
+    const uint64_t *eytz = seg_eytz_.data();
+    size_t k = 1;
+    while (k <= n)
+    {
+        __builtin_prefetch(eytz + k * 8);
+        k = 2 * k + (eytz[k] <= index);
+    }
+    // Undo the right turns taken after the last left one: k becomes the
+    // slot of the first start above `index`, or 0 if there is none
+    k >>= __builtin_ffsll(~static_cast<long long>(k));
+    size_t upper = k == 0 ? n : seg_rank_[k];
+    if (upper == 0)
+    {
+        return -1;
+    }
+    seg_hint_ = upper - 1;
+    return static_cast<int>(upper - 1);
+}
+
+// Rebuilds the directory findSegment searches from segments_
+void WAL::indexSegments()
+{
+    size_t n = segments_.size();
+    seg_starts_.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        seg_starts_[i] = segments_[i]->index;
+    }
+    seg_eytz_.assign(n + 1, 0);
+    seg_rank_.assign(n + 1, 0);
+    // An in-order walk of the implicit tree visits the slots in key order
+    size_t next = 0;
+    auto fill = [&](auto &self, size_t k) -> void
+    {
+        if (k > n)
+        {
+            return;
+        }
+        self(self, 2 * k);
+        seg_eytz_[k] = seg_starts_[next];
+        seg_rank_[k] = static_cast<uint32_t>(next++);
+        self(self, 2 * k + 1);
+    };
+    fill(fill, 1);
+    seg_hint_ = n == 0 ? 0 : n - 1;
+}
+
+// Loads the segment holding `index` whole, for callers that rewrite it.
+std::shared_ptr<WAL::Segment> WAL::loadSegment(uint64_t index)
+{
+    // Check last segment first
+    auto last_seg = segments_.back();
+    if (index >= last_seg->index)
     {
-        return found_seg;
+        return last_seg;
     }
 
     // Find in segments
@@ -545,39 +1615,208 @@ std::shared_ptr<WAL::Segment> WAL::loadSegment(uint64_t index)
     }
 
     auto seg = segments_[seg_idx];
-    if (seg->epos.empty())
+    if (seg->ebuf.empty())
     {
-        loadSegmentEntries(seg);
+        loadSegmentEntries(seg, segments_[seg_idx + 1]->index - seg->index);
     }
-
-    // Update cache
-    pushCache(seg_idx);
     return seg;
 }
 
-/**
- * "Cycle"（轮转/循环）体现在日志段的分段存储、滚动更新和复用管理机制上。
- */
-void WAL::cycleSegment()
+WAL::ColdRead WAL::coldRead(const std::shared_ptr<Segment> &seg, uint64_t index) const
 {
-    if (!sfile_)
+    ColdRead req;
+    req.path = seg->path;
+    req.id = seg->id;
+    req.index = index;
+    req.entry = index - seg->index;
+    req.bounded = req.entry < seg->epos.size();
+    req.format = seg->format;
+    req.start = req.bounded ? seg->epos[req.entry].first : 0;
+    req.end = req.bounded ? seg->epos[req.entry].second : 0;
+    return req;
+}
+
+// Reads an entry of a sealed segment through its offset index and the
+// block cache. False if either can't be read as expected.
+bool WAL::readCold(ColdRead &req, std::vector<uint8_t> *out)
+{
+    if (!req.bounded)
     {
-        throw std::runtime_error("no active segment file");
+        std::string ipath = indexPath(req.path);
+        std::vector<uint8_t> header;
+        if (!readRange(ipath, req.id * 2 + 1, 0, 16, &header) ||
+            std::memcmp(header.data(), "WALIDX1\n", 8) != 0)
+        {
+            return false;
+        }
+        uint32_t format;
+        std::memcpy(&format, header.data() + 8, 4);
+        req.format = static_cast<LogFormat>(format);
+
+        // End of the previous entry and of this one
+        uint64_t bounds[2] = {segmentHeaderSize(req.format), 0};
+        size_t n = req.entry == 0 ? 8 : 16;
+        uint64_t at = 16 + (req.entry == 0 ? 0 : req.entry - 1) * 8;
+        std::vector<uint8_t> raw;
+        if (!readRange(ipath, req.id * 2 + 1, at, at + n, &raw))
+        {
+            return false;
+        }
+        std::memcpy(reinterpret_cast<uint8_t *>(bounds) + 16 - n, raw.data(), n);
+        if (bounds[1] < bounds[0])
+        {
+            return false;
+        }
+        req.start = bounds[0];
+        req.end = bounds[1];
+        req.bounded = true;
     }
 
-    sfile_->flush();
-    // if (!options_.no_sync)
-    // {
-    //     Sync();
-    // }
-    sfile_->close();
+    std::vector<uint8_t> edata;
+    if (!readRange(req.path, req.id * 2, req.start, req.end, &edata))
+    {
+        return false;
+    }
+    uint32_t flags;
+    *out = readEntry(edata.data(), edata.size(), req.index, req.format, &flags);
+    if (flags & wal_codec::blob_flag)
+    {
+        std::vector<uint8_t> ref = std::move(*out);
+        return readBlob(req.path, ref, out);
+    }
+    return true;
+}
+
+// Reads [start, end) of a file through the block cache; missing blocks are
+// read whole with pread and cached. With a null `out` it only warms the cache.
+bool WAL::readRange(const std::string &path, uint64_t file, uint64_t start,
+                    uint64_t end, std::vector<uint8_t> *out)
+{
+    const uint64_t bs = bcache_->BlockSize();
+    if (out)
+    {
+        out->clear();
+        out->reserve(end - start);
+    }
+    size_t got = 0;
+    int fd = -1;
+    for (uint64_t b = start / bs; b * bs < end; b++)
+    {
+        auto block = bcache_->Lookup(file, b);
+        if (!block)
+        {
+            if (fd < 0 && (fd = ::open(path.c_str(), O_RDONLY)) < 0)
+            {
+                return false;
+            }
+            auto buf = std::make_shared<std::vector<uint8_t>>(bs);
+            ssize_t n = ::pread(fd, buf->data(), bs, b * bs);
+            if (n < 0)
+            {
+                ::close(fd);
+                return false;
+            }
+            buf->resize(n);
+            bcache_->Insert(file, b, buf);
+            block = buf;
+        }
+
+        uint64_t from = std::max(start, b * bs) - b * bs;
+        uint64_t to = std::min<uint64_t>(end - b * bs, block->size());
+        if (to <= from)
+        {
+            break; // Past the end of the file
+        }
+        if (out)
+        {
+            out->insert(out->end(), block->data() + from, block->data() + to);
+        }
+        got += to - from;
+        if (block->size() < bs)
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+    return got == end - start;
+}
+
+// Rescans a sealed segment whose offset index could not be used and writes
+// the index again. Its blocks get a new id so stale index blocks are dropped.
+void WAL::rebuildSegmentIndex(int seg_idx)
+{
+    auto seg = segments_[seg_idx];
+    auto loaded = std::make_shared<Segment>();
+    loaded->path = seg->path;
+    loaded->index = seg->index;
+    loadSegmentEntries(loaded, segments_[seg_idx + 1]->index - seg->index);
+
+    seg->id = loaded->id;
+    seg->format = loaded->format;
+    if (!writeSegmentIndex(*loaded))
+    {
+        // Keep the offsets in memory instead
+        seg->epos = std::move(loaded->epos);
+    }
+    seedCache(*loaded);
+}
+
+// Puts a segment that is in memory into the block cache
+void WAL::seedCache(const Segment &seg)
+{
+    const size_t bs = bcache_->BlockSize();
+    for (size_t off = 0; off < seg.ebuf.size(); off += bs)
+    {
+        size_t n = std::min(bs, seg.ebuf.size() - off);
+        bcache_->Insert(seg.id * 2, off / bs,
+                        std::make_shared<std::vector<uint8_t>>(
+                            seg.ebuf.begin() + off, seg.ebuf.begin() + off + n));
+    }
+}
 
-    // Cache the previous segment
-    pushCache(segments_.size() - 1);
+// Offset index: "WALIDX1\n", u32 format, u32 reserved, then the u64 end
+// offset of every entry. It can always be rebuilt, so it is not synced.
+bool WAL::writeSegmentIndex(const Segment &seg)
+{
+    std::vector<uint8_t> buf(16 + seg.epos.size() * 8, 0);
+    std::memcpy(buf.data(), "WALIDX1\n", 8);
+    uint32_t format = static_cast<uint32_t>(seg.format);
+    std::memcpy(buf.data() + 8, &format, 4);
+    for (size_t i = 0; i < seg.epos.size(); i++)
+    {
+        uint64_t end = seg.epos[i].second;
+        std::memcpy(buf.data() + 16 + i * 8, &end, 8);
+    }
+
+    std::string path = indexPath(seg.path);
+    std::string tmp = path + ".tmp";
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    if (!file.write(reinterpret_cast<const char *>(buf.data()), buf.size()) || !file.flush())
+    {
+        return false;
+    }
+    file.close();
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    return !ec;
+}
+
+/**
+ * "Cycle"（轮转/循环）体现在日志段的分段存储、滚动更新和复用管理机制上。
+ */
+void WAL::cycleSegment()
+{
+    sealTail();
 
     auto new_seg = std::make_shared<Segment>();
     new_seg->index = last_index_ + 1;
     new_seg->path = (fs::path(path_) / segmentName(new_seg->index)).string();
+    std::error_code ec;
+    fs::remove(indexPath(new_seg->path), ec);
+    fs::remove(blobPath(new_seg->path), ec);
 
     sfile_ = std::make_unique<std::fstream>(
         new_seg->path,
@@ -586,103 +1825,679 @@ void WAL::cycleSegment()
     {
         throw std::runtime_error("failed to create new segment file");
     }
+    initSegment(*new_seg, *sfile_);
+    appendManifest("add=" + std::to_string(new_seg->index));
 
     segments_.push_back(new_seg);
+    indexSegments();
+    openSyncFd();
+    if (!cold_path_.empty())
+    {
+        tier_cv_.notify_one();
+    }
 }
 
-void WAL::WriteBatch(Batch *batch)
+// Flushes, syncs and indexes the tail, which then leaves memory. The
+// caller puts a new tail in place.
+void WAL::sealTail()
 {
-    std::lock_guard<std::mutex> lock(mutex_);
-    if (corrupt_)
+    if (!sfile_)
     {
-        throw std::runtime_error("log corrupt");
+        throw std::runtime_error("no active segment file");
     }
-    if (closed_)
+
+    if (!sfile_->flush())
     {
-        throw std::runtime_error("log closed");
+        throw std::runtime_error("failed to write to segment file");
+    }
+    unmapTail();
+    // A segment is synced once when it is sealed, so the durable index only
+    // has to follow the tail.
+    if (options_.no_sync)
+    {
+        unsynced_segments_.push_back(segments_.back()->path);
+        if (blob_fd_ >= 0)
+        {
+            unsynced_segments_.push_back(blobPath(segments_.back()->path));
+        }
+    }
+    else
+    {
+        syncBlob();
+        if (::fdatasync(sync_fd_) != 0)
+        {
+            throw std::runtime_error("failed to sync segment file");
+        }
+        durable_index_ = last_index_;
+    }
+    closeBlob();
+    sfile_->close();
+
+    // The sealed segment leaves memory for the block cache; its offsets
+    // stay only if the index could not be written.
+    auto sealed = segments_.back();
+    bool indexed = writeSegmentIndex(*sealed);
+    seedCache(*sealed);
+    sealed->ebuf = std::vector<uint8_t>();
+    if (indexed)
+    {
+        sealed->epos = std::vector<std::pair<size_t, size_t>>();
+    }
+}
+
+void WAL::WriteBatch(Batch *batch)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (corrupt_)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+    if (closed_)
+    {
+        throw std::runtime_error("log closed");
+    }
+    return writeBatchInternal(batch);
+}
+
+std::future<uint64_t> WAL::WriteAsync(Batch *batch)
+{
+    auto promise = std::make_shared<std::promise<uint64_t>>();
+    std::future<uint64_t> future = promise->get_future();
+    WriteAsync(batch, [promise](uint64_t index, std::exception_ptr error)
+               {
+        if (error)
+        {
+            promise->set_exception(error);
+        }
+        else
+        {
+            promise->set_value(index);
+        } });
+    return future;
+}
+
+void WAL::WriteAsync(Batch *batch, WriteCallback done)
+{
+    uint64_t index;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (corrupt_)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        if (closed_)
+        {
+            throw std::runtime_error("log closed");
+        }
+        writeBatchInternal(batch, true);
+        index = last_index_;
+
+        // no_sync logs never sync, so written is as good as it gets
+        if (!options_.no_sync && (index > durable_index_ || !async_writes_.empty()))
+        {
+            async_writes_.push_back({index, std::move(done), nullptr});
+            // Close stops the thread before it takes the lock and completes
+            // whatever is left itself
+            if (!sync_thread_.joinable() && !sync_stop_)
+            {
+                sync_thread_ = std::thread(&WAL::syncLoop, this);
+            }
+            sync_cv_.notify_one();
+            return;
+        }
+    }
+    done(index, nullptr);
+}
+
+void WAL::writeBatchInternal(Batch *batch, bool defer_sync)
+{
+    std::vector<EntryRef> refs;
+    refs.reserve(batch->entries.size());
+    size_t data_pos = 0;
+    for (const auto &entry : batch->entries)
+    {
+        refs.push_back({entry.index, batch->datas.data() + data_pos, entry.size, entry.meta});
+        data_pos += entry.size;
+    }
+    writeEntriesInternal(refs.data(), refs.size(), defer_sync);
+    batch->Clear();
+}
+
+void WAL::writeEntriesInternal(const EntryRef *entries, size_t count, bool defer_sync)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    if (!reserved_.entries.empty())
+    {
+        throw std::runtime_error("reservation pending");
+    }
+    if (importing_)
+    {
+        throw std::runtime_error("import in progress");
+    }
+
+    // Check indexes are sequential
+    bool meta = false;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (entries[i].index != last_index_ + i + 1)
+        {
+            throw std::runtime_error("out of order");
+        }
+        meta = meta || wal_codec::HasMeta(entries[i].meta);
+    }
+    // Binary records have no room for it; that includes a Binary tail left
+    // by an older configuration
+    if (meta && (options_.log_format == LogFormat::Binary ||
+                 segments_.back()->format == LogFormat::Binary))
+    {
+        throw std::runtime_error("entry metadata needs BinaryV2 or JSON");
+    }
+    if (segments_.back()->ebuf.size() > options_.segment_size)
+    {
+        cycleSegment();
+    }
+
+    // One dispatch per segment filled; a cycle may switch the tail's format
+    for (size_t done = 0; done < count;)
+    {
+        done += wal_codec::WithCodec(segments_.back()->format, [&](auto codec)
+                                     { return appendToTail<decltype(codec)>(
+                                           entries + done, count - done); });
+    }
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        bytes += entries[i].size;
+    }
+    syncWritten(bytes, count, defer_sync);
+}
+
+// Encodes entries into the tail and writes them out, stopping after the
+// entry that fills the segment. Returns the number of entries taken.
+template <typename Codec>
+size_t WAL::appendToTail(const EntryRef *entries, size_t count)
+{
+    auto seg = segments_.back();
+    size_t mark = seg->ebuf.size();
+    size_t marked = seg->epos.size();
+    size_t marked_meta = seg->meta.size();
+    size_t taken = count;
+
+    try
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const auto &entry = entries[i];
+            size_t pos = seg->ebuf.size();
+            bool blob = false;
+            if constexpr (Codec::has_flags)
+            {
+                blob = options_.blob_threshold > 0 && entry.size >= options_.blob_threshold;
+            }
+            if (blob)
+            {
+                uint8_t ref[blob_ref_size];
+                appendBlob(entry.data, entry.size, ref);
+                Codec::Append(seg->ebuf, entry.index, ref, sizeof(ref), wal_codec::blob_flag,
+                              entry.meta);
+            }
+            else
+            {
+                Codec::Append(seg->ebuf, entry.index, entry.data, entry.size, 0, entry.meta);
+            }
+            seg->epos.emplace_back(pos, seg->ebuf.size());
+            if (wal_codec::HasMeta(entry.meta))
+            {
+                seg->meta.resize(seg->epos.size() - 1);
+                seg->meta.push_back(entry.meta);
+            }
+            if (seg->ebuf.size() >= options_.segment_size)
+            {
+                taken = i + 1;
+                break;
+            }
+        }
+    }
+    catch (...)
+    {
+        // Nothing reached the file yet; drop the half-encoded batch
+        seg->ebuf.resize(mark);
+        seg->epos.resize(marked);
+        seg->meta.resize(marked_meta);
+        throw;
+    }
+
+    if (seg->ebuf.size() > mark)
+    {
+        try
+        {
+            writeTail(mark);
+        }
+        catch (...)
+        {
+            // Part of the batch may be in the file already
+            seg->ebuf.resize(mark);
+            seg->epos.resize(marked);
+            seg->meta.resize(marked_meta);
+            corrupt_ = true;
+            throw;
+        }
+        last_index_ = entries[taken - 1].index;
+    }
+    if (seg->ebuf.size() >= options_.segment_size)
+    {
+        cycleSegment();
+    }
+    return taken;
+}
+
+bool WAL::backgroundSync() const
+{
+    return !options_.no_sync &&
+           (options_.sync_interval_ms > 0 || options_.sync_bytes > 0 || options_.sync_entries > 0);
+}
+
+// Points sync_fd_ at the current tail, and maps it with mmap_tail
+void WAL::openSyncFd()
+{
+    unmapTail();
+    if (sync_fd_ >= 0)
+    {
+        ::close(sync_fd_);
+    }
+    sync_fd_ = ::open(segments_.back()->path.c_str(), O_RDWR);
+    if (sync_fd_ < 0)
+    {
+        throw std::runtime_error("failed to open segment file");
+    }
+    auto &seg = *segments_.back();
+    if (options_.mmap_tail && seg.format != LogFormat::Binary)
+    {
+        tail_map_used_ = seg.ebuf.size();
+        mapTail(seg.ebuf.size());
+    }
+}
+
+// (Re)maps at least `need` bytes of the tail, growing the file by a segment
+// first and doubling after. fdatasync on sync_fd_ also flushes the mapping.
+void WAL::mapTail(size_t need)
+{
+    size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t len = std::max({need, options_.segment_size, tail_map_len_ * 2});
+    len = (len + page - 1) / page * page;
+    if (tail_map_)
+    {
+        ::munmap(tail_map_, tail_map_len_);
+        tail_map_ = nullptr;
+        tail_map_len_ = 0;
+    }
+    else
+    {
+        // Durable before the zeros are, so an open after a crash knows to
+        // look for them
+        if (!WriteFileSync(preallocPath(segments_.back()->path), "", 0, options_.file_perms))
+        {
+            throw std::runtime_error("failed to preallocate segment file");
+        }
+        if (!options_.no_sync)
+        {
+            SyncPath(path_);
+        }
+    }
+    if (::ftruncate(sync_fd_, static_cast<off_t>(len)) != 0)
+    {
+        throw std::runtime_error("failed to preallocate segment file");
+    }
+    void *p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, sync_fd_, 0);
+    if (p == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map segment file");
+    }
+    tail_map_ = static_cast<uint8_t *>(p);
+    tail_map_len_ = len;
+}
+
+// Drops the tail mapping and cuts the preallocated zeros off the file
+void WAL::unmapTail()
+{
+    if (!tail_map_)
+    {
+        return;
+    }
+    ::munmap(tail_map_, tail_map_len_);
+    tail_map_ = nullptr;
+    tail_map_len_ = 0;
+    if (::ftruncate(sync_fd_, static_cast<off_t>(tail_map_used_)) != 0 ||
+        (!options_.no_sync && ::fdatasync(sync_fd_) != 0))
+    {
+        throw std::runtime_error("failed to trim segment file");
+    }
+    fs::remove(preallocPath(segments_.back()->path));
+}
+
+// Writes the tail buffer from `from` on to the tail file
+void WAL::writeTail(size_t from)
+{
+    const auto &ebuf = segments_.back()->ebuf;
+    if (tail_map_)
+    {
+        if (ebuf.size() > tail_map_len_)
+        {
+            mapTail(ebuf.size());
+        }
+        std::memcpy(tail_map_ + from, ebuf.data() + from, ebuf.size() - from);
+        tail_map_used_ = ebuf.size();
+        return;
+    }
+    if (!sfile_->write(reinterpret_cast<const char *>(ebuf.data() + from),
+                       ebuf.size() - from))
+    {
+        throw std::runtime_error("failed to write to segment file");
+    }
+}
+
+// Called after entries reach the tail file. Syncs now, or leaves it to the
+// sync thread under a background policy or for WriteAsync.
+void WAL::syncWritten(size_t bytes, size_t entries, bool defer_sync)
+{
+    if (options_.no_sync)
+    {
+        return;
+    }
+    if (!sfile_->flush())
+    {
+        corrupt_ = true;
+        throw std::runtime_error("failed to write to segment file");
+    }
+    if (!backgroundSync() && !defer_sync)
+    {
+        try
+        {
+            syncBlob();
+        }
+        catch (...)
+        {
+            corrupt_ = true;
+            throw;
+        }
+        if (::fdatasync(sync_fd_) != 0)
+        {
+            corrupt_ = true;
+            throw std::runtime_error("failed to sync segment file");
+        }
+        durable_index_ = last_index_;
+        // This also covered any WriteAsync batches still waiting
+        unsynced_bytes_ = 0;
+        unsynced_entries_ = 0;
+        if (asyncReady())
+        {
+            sync_cv_.notify_one();
+        }
+        return;
+    }
+
+    if (unsynced_entries_ == 0)
+    {
+        unsynced_since_ = std::chrono::steady_clock::now();
+        sync_cv_.notify_one(); // Starts the interval clock
+    }
+    unsynced_bytes_ += bytes;
+    unsynced_entries_ += entries;
+    if (defer_sync ||
+        (options_.sync_bytes > 0 && unsynced_bytes_ >= options_.sync_bytes) ||
+        (options_.sync_entries > 0 && unsynced_entries_ >= options_.sync_entries))
+    {
+        sync_cv_.notify_one();
+    }
+}
+
+// Syncs the tail when the policy calls for it, with mutex_ released so
+// writers keep appending, and completes WriteAsync batches once durable.
+void WAL::syncLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto due = [this]
+    {
+        return sync_stop_ || !async_writes_.empty() ||
+               (options_.sync_bytes > 0 && unsynced_bytes_ >= options_.sync_bytes) ||
+               (options_.sync_entries > 0 && unsynced_entries_ >= options_.sync_entries);
+    };
+    for (;;)
+    {
+        sync_cv_.wait(lock, [this]
+                      { return sync_stop_ || unsynced_entries_ > 0 || asyncReady(); });
+        if (unsynced_entries_ > 0 && async_writes_.empty())
+        {
+            if (options_.sync_interval_ms > 0)
+            {
+                auto deadline = unsynced_since_ +
+                                std::chrono::milliseconds(options_.sync_interval_ms);
+                sync_cv_.wait_until(lock, deadline, due);
+            }
+            else
+            {
+                sync_cv_.wait(lock, due);
+            }
+        }
+        if (sync_stop_ || closed_)
+        {
+            return;
+        }
+        if (corrupt_)
+        {
+            std::vector<AsyncWrite> writes = takeAsyncWrites("log corrupt");
+            lock.unlock();
+            completeAsyncWrites(writes);
+            return;
+        }
+
+        if (unsynced_entries_ > 0)
+        {
+            uint64_t target = last_index_;
+            uint64_t gen = cut_gen_.load();
+            int fd = ::dup(sync_fd_);
+            bool blob = blob_dirty_;
+            int blob_fd = blob ? ::dup(blob_fd_) : -1;
+            blob_dirty_ = false;
+            unsynced_bytes_ = 0;
+            unsynced_entries_ = 0;
+
+            lock.unlock();
+            // Blob bytes first, then the records that point at them
+            bool ok = (!blob || (blob_fd >= 0 && ::fdatasync(blob_fd) == 0)) &&
+                      fd >= 0 && ::fdatasync(fd) == 0;
+            if (blob_fd >= 0)
+            {
+                ::close(blob_fd);
+            }
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+            lock.lock();
+
+            if (!ok)
+            {
+                corrupt_ = true;
+                std::vector<AsyncWrite> writes =
+                    takeAsyncWrites("failed to sync segment file");
+                lock.unlock();
+                completeAsyncWrites(writes);
+                return;
+            }
+            if (cut_gen_.load() == gen)
+            {
+                durable_index_ = std::max(durable_index_, target);
+            }
+            else if (durable_index_ < last_index_ && unsynced_entries_ == 0)
+            {
+                // A back truncation meanwhile may have rewritten the tail
+                // into another file; sync again
+                unsynced_entries_ = 1;
+                unsynced_since_ = std::chrono::steady_clock::now();
+            }
+        }
+
+        if (asyncReady())
+        {
+            std::vector<AsyncWrite> writes = takeAsyncWrites(nullptr);
+            lock.unlock();
+            completeAsyncWrites(writes);
+            lock.lock();
+        }
+    }
+}
+
+bool WAL::asyncReady() const
+{
+    return !async_writes_.empty() &&
+           (async_writes_.front().error || async_writes_.front().index <= durable_index_);
+}
+
+// Removes the WriteAsync batches that can complete now. With `fail_rest`,
+// the ones that are not durable are removed too, failed with that message.
+std::vector<WAL::AsyncWrite> WAL::takeAsyncWrites(const char *fail_rest)
+{
+    std::vector<AsyncWrite> writes;
+    while (asyncReady())
+    {
+        writes.push_back(std::move(async_writes_.front()));
+        async_writes_.pop_front();
+    }
+    if (fail_rest)
+    {
+        for (auto &w : async_writes_)
+        {
+            if (!w.error)
+            {
+                w.error = std::make_exception_ptr(std::runtime_error(fail_rest));
+            }
+            writes.push_back(std::move(w));
+        }
+        async_writes_.clear();
+    }
+    return writes;
+}
+
+// Runs completions without mutex_, so callbacks may use the log
+void WAL::completeAsyncWrites(std::vector<AsyncWrite> &writes)
+{
+    for (auto &w : writes)
+    {
+        try
+        {
+            w.done(w.index, w.error);
+        }
+        catch (...)
+        {
+            // A throwing callback must not take the sync thread down
+        }
+    }
+}
+
+void WAL::stopSync()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sync_stop_ = true;
+    }
+    sync_cv_.notify_all();
+    if (sync_thread_.joinable())
+    {
+        sync_thread_.join();
+    }
+}
+
+uint64_t WAL::AppendNext(const std::vector<uint8_t> &data)
+{
+    return AppendNext(data.data(), data.size());
+}
+
+uint64_t WAL::AppendNext(const uint8_t *data, size_t size)
+{
+    AppendNode node;
+    node.entry = {0, data, size};
+
+    AppendNode *head = append_head_.load(std::memory_order_relaxed);
+    do
+    {
+        node.next = head;
+    } while (!append_head_.compare_exchange_weak(
+        head, &node, std::memory_order_release, std::memory_order_relaxed));
+
+    // Whoever holds the log next writes every queued node, so most
+    // producers find their entry already written once they get the lock.
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!node.done)
+    {
+        drainAppendsInternal();
+    }
+    if (node.error)
+    {
+        std::rethrow_exception(node.error);
     }
-    return writeBatchInternal(batch);
+    return node.entry.index;
 }
 
-void WAL::writeBatchInternal(Batch *batch)
+void WAL::drainAppendsInternal()
 {
-    if (batch->entries.empty())
-    {
-        return;
-    }
+    AppendNode *list = append_head_.exchange(nullptr, std::memory_order_acquire);
 
-    // Check indexes are sequential
-    for (size_t i = 0; i < batch->entries.size(); i++)
+    // The stack is newest first; indexes are assigned in arrival order
+    std::vector<AppendNode *> nodes;
+    for (; list; list = list->next)
     {
-        if (batch->entries[i].index != last_index_ + i + 1)
-        {
-            throw std::runtime_error("out of order");
-        }
+        nodes.push_back(list);
     }
-    auto seg = segments_.back();
+    std::reverse(nodes.begin(), nodes.end());
 
-    if (seg->ebuf.size() > options_.segment_size)
+    std::vector<EntryRef> refs;
+    refs.reserve(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
     {
-        cycleSegment();
-        seg = segments_.back();
+        nodes[i]->entry.index = last_index_ + i + 1;
+        refs.push_back(nodes[i]->entry);
     }
 
-    size_t data_pos = 0;
-    size_t mark = seg->ebuf.size();
-
-    for (size_t i = 0; i < batch->entries.size(); i++)
+    std::exception_ptr error;
+    try
     {
-        const auto &entry = batch->entries[i];
-        std::vector<uint8_t> data(
-            batch->datas.begin() + data_pos,
-            batch->datas.begin() + data_pos + entry.size);
-
-        auto [new_ebuf, epos] = appendEntry(
-            seg->ebuf, entry.index, data, options_.log_format);
-        seg->ebuf = new_ebuf;
-        seg->epos.push_back(epos);
-
-        if (seg->ebuf.size() >= options_.segment_size)
+        if (corrupt_)
         {
-            // Write current content and cycle
-            if (!sfile_->write(
-                    reinterpret_cast<const char *>(seg->ebuf.data() + mark),
-                    seg->ebuf.size() - mark))
-            {
-                throw std::runtime_error("failed to write to segment file");
-            }
-
-            last_index_ = entry.index;
-            cycleSegment();
-            seg = segments_.back();
-            mark = 0;
+            throw std::runtime_error("log corrupt");
         }
-
-        data_pos += entry.size;
-    }
-
-    if (seg->ebuf.size() - mark > 0)
-    {
-        if (!sfile_->write(
-                reinterpret_cast<const char *>(seg->ebuf.data() + mark),
-                seg->ebuf.size() - mark))
+        if (closed_)
         {
-            throw std::runtime_error("failed to write to segment file");
+            throw std::runtime_error("log closed");
         }
-        last_index_ = batch->entries.back().index;
+        writeEntriesInternal(refs.data(), refs.size());
     }
-
-    if (!options_.no_sync)
+    catch (...)
     {
-        // Sync();
-        sfile_->flush();
+        error = std::current_exception();
     }
 
-    batch->Clear();
+    for (auto *node : nodes)
+    {
+        node->error = error;
+        node->done = true;
+    }
 }
 
 void WAL::truncateFrontInternal(uint64_t index)
 {
+    if (!reserved_.entries.empty())
+    {
+        throw std::runtime_error("reservation pending");
+    }
+    if (importing_)
+    {
+        throw std::runtime_error("import in progress");
+    }
     if (index == 0 || last_index_ == 0 || index < first_index_ || index > last_index_)
     {
         throw std::runtime_error("out of range");
@@ -692,101 +2507,32 @@ void WAL::truncateFrontInternal(uint64_t index)
         return;
     }
 
+    // Front truncation is logical: segments wholly before `index` are
+    // dropped and the entries ahead of it in its own segment are skipped.
     int seg_idx = findSegment(index);
-    auto seg = loadSegment(index);
-    auto epos = std::vector<std::pair<size_t, size_t>>(
-        seg->epos.begin() + (index - seg->index),
-        seg->epos.end());
-    std::cout << "epos size: " << epos.size() << std::endl;
-
-    std::vector<uint8_t> ebuf(
-        seg->ebuf.begin() + epos[0].first,
-        seg->ebuf.end());
-
-    // Create temp file
-    fs::path temp_path = fs::path(path_) / "TEMP";
+    std::string edit;
+    for (int i = 0; i < seg_idx; i++)
     {
-        std::ofstream temp_file(temp_path, std::ios::binary | std::ios::trunc);
-        if (!temp_file.write(reinterpret_cast<const char *>(ebuf.data()), ebuf.size()))
-        {
-            throw std::runtime_error("failed to write temp file");
-        }
-        temp_file.close();
+        edit += "del=" + std::to_string(segments_[i]->index) + " ";
     }
+    edit += "front=" + std::to_string(index);
 
-    // Rename to START file
-    fs::path start_path = fs::path(path_) / (segmentName(index) + ".START");
-    fs::rename(temp_path, start_path);
+    appendManifest(edit);
 
     try
     {
-        if (seg_idx == static_cast<int>(segments_.size()) - 1)
-        {
-            // Close tail segment
-            sfile_->close();
-        }
-
-        // Delete truncated segments
-        for (int i = 0; i <= seg_idx; i++)
+        for (int i = 0; i < seg_idx; i++)
         {
             fs::remove(segments_[i]->path);
+            fs::remove(indexPath(segments_[i]->path));
+            fs::remove(blobPath(segments_[i]->path));
+            forgetUnsynced(segments_[i]->path);
         }
-
-        // Rename START to final name
-        fs::path new_path = fs::path(path_) / segmentName(index);
-        fs::rename(start_path, new_path);
-
-        seg->path = new_path.string();
-        seg->index = index;
-
-        if (seg_idx == static_cast<int>(segments_.size()) - 1)
-        {
-            // Reopen tail segment
-            sfile_ = std::make_unique<std::fstream>(
-                new_path,
-                std::ios::binary | std::ios::out | std::ios::in);
-            if (!*sfile_)
-            {
-                throw std::runtime_error("failed to reopen segment file");
-            }
-
-            sfile_->seekp(0, std::ios::end);
-            if (sfile_->tellp() != static_cast<std::streampos>(ebuf.size()))
-            {
-                throw std::runtime_error("invalid seek");
-            }
-
-            loadSegmentEntries(seg);
-        }
-
-        std::cout << "Before truncation, segments size: " << segments_.size() << std::endl;
-        // segments_.erase(segments_.begin(), segments_.begin() + seg_idx + 1);
-
-        // 创建新 vector，包含 segments_[seg_idx] 到末尾的元素
-        std::vector<std::shared_ptr<Segment>> new_segments(
-            segments_.begin() + seg_idx,
-            segments_.end());
-        segments_ = std::move(new_segments); // 替换原 segments_
-
-        // // 删除旧 Segment
-        // if (seg_idx + 1 < segments_.size())
-        // {
-        //     segments_.erase(segments_.begin(), segments_.begin() + seg_idx + 1);
-        // }
-        // else
-        // {
-        //     // 处理删除全部 Segment 的情况
-        //     segments_.clear();
-        //     segments_.push_back(std::make_shared<Segment>());
-        //     segments_[0]->path = new_path.string(); // 新文件路径
-        //     segments_[0]->index = index;
-        //     segments_[0]->epos = std::move(epos);
-        //     segments_[0]->ebuf = std::move(ebuf);
-        // }
+        segments_.erase(segments_.begin(), segments_.begin() + seg_idx);
+        indexSegments();
 
         // 更新 first_index_
         first_index_ = index;
-        clearCacheInternal();
     }
     catch (...)
     {
@@ -797,7 +2543,14 @@ void WAL::truncateFrontInternal(uint64_t index)
 
 void WAL::truncateBackInternal(uint64_t index)
 {
-    std::cout << "Truncating back to index: " << index << std::endl;
+    if (!reserved_.entries.empty())
+    {
+        throw std::runtime_error("reservation pending");
+    }
+    if (importing_)
+    {
+        throw std::runtime_error("import in progress");
+    }
     if (index == 0 || last_index_ == 0 || index < first_index_ || index > last_index_)
     {
         throw std::runtime_error("out of range");
@@ -808,102 +2561,172 @@ void WAL::truncateBackInternal(uint64_t index)
     }
 
     int seg_idx = findSegment(index);
-    std::cout << "Segment index found: " << seg_idx << std::endl;
     auto seg = loadSegment(index);
-    std::cout << "Loaded segment: " << seg->path << std::endl;
-    auto epos = std::vector<std::pair<size_t, size_t>>(
-        seg->epos.begin(),
-        seg->epos.begin() + (index - seg->index + 1));
-    std::cout << "epos content: [";
-    for (const auto &entry : epos)
-    {
-        std::cout << "(" << entry.first << ", " << entry.second << "), ";
-    }
-    std::cout << "]" << std::endl;
 
-    std::cout << ">>>>>>>>>>>>>>>>>>>>> seg->index: " << seg->index << std::endl;
-    std::cout << "index - seg->index + 1: " << index - seg->index + 1 << std::endl;
+    // The kept prefix ends exactly at the boundary of the entry at `index`,
+    // which is already known from epos, so the segment can be cut in place.
+    size_t count = index - seg->index + 1;
+    size_t boundary = seg->epos[count - 1].second;
+    bool is_tail = seg_idx == static_cast<int>(segments_.size()) - 1;
 
-    std::vector<uint8_t> ebuf(
-        seg->ebuf.begin(),
-        seg->ebuf.begin() + epos.back().second);
+    // A cut inside the tail shrinks it in place under a `back` edit, which
+    // bounds it until the cut is synced. A cut inside a sealed segment seals
+    // it at `index` and starts a new empty tail at `index + 1`, whose add edit
+    // bounds the sealed segment instead. Either way bytes left by a crash
+    // before the cut are never read back.
+    bool at_boundary = !is_tail && segments_[seg_idx + 1]->index == index + 1;
 
-    std::string str(ebuf.begin(), ebuf.end());
-    std::cout << "ebuf Content: " << str << std::endl; // 输出: Hello
-
-    // Create temp file
-    std::cout << "Creating temp file for truncation..." << std::endl;
-    fs::path temp_path = fs::path(path_) / "TEMP";
+    std::string edit;
+    for (size_t i = seg_idx + 1; i < segments_.size(); i++)
     {
-        std::ofstream temp_file(temp_path, std::ios::binary | std::ios::trunc);
-        if (!temp_file.write(reinterpret_cast<const char *>(ebuf.data()), ebuf.size()))
-        {
-            throw std::runtime_error("failed to write temp file");
-        }
-
-        temp_file.close();
+        edit += "del=" + std::to_string(segments_[i]->index) + " ";
     }
 
-    // Rename to END file
-    fs::path end_path = fs::path(path_) / (segmentName(seg->index) + ".END");
-    fs::rename(temp_path, end_path);
+    std::shared_ptr<Segment> new_tail;
+    if (is_tail)
+    {
+        edit += "back=" + std::to_string(index);
+    }
+    else if (!at_boundary)
+    {
+        new_tail = std::make_shared<Segment>();
+        new_tail->index = index + 1;
+        new_tail->path = (fs::path(path_) / segmentName(new_tail->index)).string();
+        edit += "add=" + std::to_string(new_tail->index);
+    }
 
+    // The tail is closed from here on, so any failure leaves the log corrupt
     try
     {
-        // Close tail segment
+        sfile_->flush();
         sfile_->close();
+        unmapTail();
+        // Kept entries may still rely on unsynced blob bytes
+        if (!options_.no_sync)
+        {
+            syncBlob();
+        }
+        closeBlob();
+        if (new_tail)
+        {
+            // Created before the edit is logged so the manifest never names a
+            // segment that might hold old contents.
+            fs::remove(indexPath(new_tail->path));
+            fs::remove(blobPath(new_tail->path));
+            std::ofstream created(new_tail->path, std::ios::binary | std::ios::trunc);
+            if (!created)
+            {
+                throw std::runtime_error("failed to create new segment file");
+            }
+            initSegment(*new_tail, created);
+        }
 
-        // Delete truncated segments
-        for (int i = seg_idx; i < static_cast<int>(segments_.size()); i++)
+        appendManifest(edit);
+
+        for (int i = static_cast<int>(segments_.size()) - 1; i > seg_idx; i--)
         {
             fs::remove(segments_[i]->path);
+            fs::remove(indexPath(segments_[i]->path));
+            fs::remove(blobPath(segments_[i]->path));
+            forgetUnsynced(segments_[i]->path);
+        }
+        segments_.erase(segments_.begin() + seg_idx + 1, segments_.end());
+
+        // Reclaim the cut-off bytes; the manifest already bounds the segment.
+        // Its bytes change, so cached blocks are orphaned by a new id and
+        // readers that raced the cut retry.
+        struct stat st;
+        bool to_hot = !new_tail && isCold(*seg);
+        if (to_hot || (::stat(seg->path.c_str(), &st) == 0 && st.st_nlink > 1))
+        {
+            // Shared with a checkpoint: the kept prefix goes to a new inode.
+            // A cold segment that becomes the tail goes back to the hot tier.
+            std::string dst = to_hot
+                                  ? (fs::path(path_) / segmentName(seg->index)).string()
+                                  : seg->path;
+            std::string tmp = dst + ".tmp";
+            if (!WriteFileSync(tmp, seg->ebuf.data(), boundary, options_.file_perms))
+            {
+                throw std::runtime_error("failed to rewrite segment file");
+            }
+            fs::rename(tmp, dst);
+            if (to_hot)
+            {
+                if (fs::exists(blobPath(seg->path)))
+                {
+                    fs::copy_file(blobPath(seg->path), blobPath(dst),
+                                  fs::copy_options::overwrite_existing);
+                    fs::remove(blobPath(seg->path));
+                }
+                fs::remove(seg->path);
+                fs::remove(indexPath(seg->path));
+                seg->path = dst;
+            }
+        }
+        else
+        {
+            fs::resize_file(seg->path, boundary);
         }
+        seg->ebuf.resize(boundary);
+        seg->epos.resize(count);
+        if (seg->meta.size() > count)
+        {
+            seg->meta.resize(count);
+        }
+        seg->id = NewSegmentId();
+        cut_gen_++;
 
-        // Rename END to final name
-        fs::path new_path = fs::path(path_) / segmentName(seg->index);
-        fs::rename(end_path, new_path);
+        if (new_tail)
+        {
+            // The cut segment is sealed now; kept offsets are unchanged
+            bool indexed = writeSegmentIndex(*seg);
+            seedCache(*seg);
+            seg->ebuf = std::vector<uint8_t>();
+            if (indexed)
+            {
+                seg->epos = std::vector<std::pair<size_t, size_t>>();
+            }
+            segments_.push_back(new_tail);
+        }
+        else
+        {
+            fs::remove(indexPath(seg->path));
+        }
+        indexSegments();
 
         // Reopen tail segment
         sfile_ = std::make_unique<std::fstream>(
-            new_path,
+            segments_.back()->path,
             std::ios::binary | std::ios::out | std::ios::in);
         if (!*sfile_)
         {
             throw std::runtime_error("failed to reopen segment file");
         }
-
         sfile_->seekp(0, std::ios::end);
-        if (sfile_->tellp() != static_cast<std::streampos>(ebuf.size()))
-        {
-            throw std::runtime_error("invalid seek");
-        }
-
-        seg->path = new_path.string();
-        // segments_.erase(segments_.begin() + seg_idx + 1, segments_.end());
-
-        // 创建新 vector，包含 segments_[0] 到 segments_[seg_idx] 的元素
-        std::vector<std::shared_ptr<Segment>> new_segments(
-            segments_.begin(),
-            segments_.begin() + seg_idx + 1);
-        segments_ = std::move(new_segments); // 替换原 segments_
-
-        // 向后删除：移除 seg_idx + 1 之后的所有 Segments
-        // if (seg_idx + 1 < segments_.size())
-        // {
-        //     segments_.erase(segments_.begin() + seg_idx + 1, segments_.end());
-        // }
-        // else
-        // {
-        //     // 处理 seg_idx 指向最后一个 Segment 的情况（无需删除）
-        //     // 可选：更新当前 Segment 的元数据（如需要）
-        //     segments_.back()->epos = std::move(epos);
-        //     segments_.back()->ebuf = std::move(ebuf);
-        //     segments_.back()->index = index; // 如果 index 变化
-        // }
+        openSyncFd();
+        if (is_tail)
+        {
+            // Once the cut is durable the bound must not cap later appends
+            if (!options_.no_sync && ::fdatasync(sync_fd_) != 0)
+            {
+                throw std::runtime_error("failed to sync segment file");
+            }
+            appendManifest("back=0");
+        }
 
         last_index_ = index;
-        clearCacheInternal();
-        loadSegmentEntries(seg);
+        durable_index_ = std::min(durable_index_, index);
+        for (auto &w : async_writes_)
+        {
+            if (w.index > index && !w.error)
+            {
+                w.error = std::make_exception_ptr(std::runtime_error("entry truncated"));
+            }
+        }
+        if (asyncReady())
+        {
+            sync_cv_.notify_one();
+        }
     }
     catch (...)
     {
@@ -912,203 +2735,357 @@ void WAL::truncateBackInternal(uint64_t index)
     }
 }
 
-void WAL::pushCache(int seg_idx)
+// A sequential reader in the last quarter of a sealed segment queues the
+// next sealed segment to be read into the block cache.
+void WAL::maybeReadahead(const std::shared_ptr<Segment> &seg, uint64_t index)
 {
-    if (seg_idx < 0 || seg_idx >= static_cast<int>(segments_.size()))
+    int cur = findSegment(seg->index);
+    int next = cur + 1;
+    // The tail is always resident, so only sealed successors are read
+    if (cur < 0 || next >= static_cast<int>(segments_.size()) - 1)
     {
         return;
     }
-
-    // 使用 set_evicted 方法更新缓存
-    auto [prev, replaced, evicted_key, evicted_value, evicted] = scache_.set_evicted(
-        seg_idx,           // key: segment index
-        segments_[seg_idx] // value: segment pointer
-    );
-
-    // 处理被淘汰的 segment 数据清理
-    if (evicted)
+    size_t count = segments_[next]->index - seg->index;
+    if (index - seg->index + 1 < count - count / 4)
     {
-        // 清理被淘汰 segment 的内存占用
-        evicted_value->ebuf.clear();
-        evicted_value->ebuf.shrink_to_fit();
-        evicted_value->epos.clear();
-        evicted_value->epos.shrink_to_fit();
+        return;
+    }
+    auto next_seg = segments_[next];
+    if (bcache_->Lookup(next_seg->id * 2, 0))
+    {
+        return;
     }
-}
-
-void WAL::clearCacheInternal()
-{
-    scache_.clear(); // 清除所有缓存的 segment
-}
 
-std::string WAL::segmentName(uint64_t index)
-{
-    std::ostringstream oss;
-    oss << std::setw(20) << std::setfill('0') << index;
-    return oss.str();
+    std::lock_guard<std::mutex> lock(ra_mutex_);
+    if (ra_stop_ || !ra_pending_.insert(next_seg->id).second)
+    {
+        return;
+    }
+    ra_queue_.push_back({next_seg->path, next_seg->id});
+    if (!ra_thread_.joinable())
+    {
+        ra_thread_ = std::thread(&WAL::readaheadLoop, this);
+    }
+    ra_cv_.notify_all(); // waitReadahead callers share the condition
 }
 
-std::pair<std::vector<uint8_t>, std::pair<size_t, size_t>>
-WAL::appendEntry(const std::vector<uint8_t> &dst, uint64_t index,
-                 const std::vector<uint8_t> &data, LogFormat format)
+void WAL::readaheadLoop()
 {
-    std::vector<uint8_t> out = dst;
-    size_t pos = out.size();
-
-    if (format == LogFormat::JSON)
+    for (;;)
     {
-        // {"index":"number","data":"base64encoded"}
-        std::string json = "{\"index\":\"" + std::to_string(index) + "\",\"data\":\"";
-
-        // Check if data is valid UTF-8
-        bool is_utf8 = true;
-        const char *str = reinterpret_cast<const char *>(data.data());
-        size_t len = data.size();
-        for (size_t i = 0; i < len;)
+        ReadaheadRequest req;
         {
-            unsigned char c = str[i];
-            if (c <= 0x7F)
-            {
-                i++;
-            }
-            else if ((c & 0xE0) == 0xC0)
-            {
-                if (i + 1 >= len || (str[i + 1] & 0xC0) != 0x80)
-                {
-                    is_utf8 = false;
-                    break;
-                }
-                i += 2;
-            }
-            else if ((c & 0xF0) == 0xE0)
-            {
-                if (i + 2 >= len || (str[i + 1] & 0xC0) != 0x80 ||
-                    (str[i + 2] & 0xC0) != 0x80)
-                {
-                    is_utf8 = false;
-                    break;
-                }
-                i += 3;
-            }
-            else if ((c & 0xF8) == 0xF0)
-            {
-                if (i + 3 >= len || (str[i + 1] & 0xC0) != 0x80 ||
-                    (str[i + 2] & 0xC0) != 0x80 ||
-                    (str[i + 3] & 0xC0) != 0x80)
-                {
-                    is_utf8 = false;
-                    break;
-                }
-                i += 4;
-            }
-            else
+            std::unique_lock<std::mutex> lock(ra_mutex_);
+            ra_cv_.wait(lock, [this]
+                        { return ra_stop_ || !ra_queue_.empty(); });
+            if (ra_stop_)
             {
-                is_utf8 = false;
-                break;
+                return;
             }
+            req = ra_queue_.front();
+            ra_queue_.pop_front();
         }
 
-        if (is_utf8)
+        // Warm at most half the cache so the blocks being read now survive.
+        // Failures are left to the foreground read to report.
+        uint64_t budget = bcache_->Capacity() / 2;
+        std::error_code ec;
+        std::string ipath = indexPath(req.path);
+        uint64_t isize = fs::file_size(ipath, ec);
+        if (!ec)
         {
-            json += "+";
-            json.append(str, len);
+            isize = std::min(isize, budget);
+            readRange(ipath, req.id * 2 + 1, 0, isize, nullptr);
+            budget -= isize;
         }
-        else
+        uint64_t size = fs::file_size(req.path, ec);
+        if (!ec)
         {
-            json += "$";
-            json += base64_encode(data.data(), data.size(), false);
+            readRange(req.path, req.id * 2, 0, std::min(size, budget), nullptr);
         }
-        json += "\"}\n";
 
-        out.insert(out.end(), json.begin(), json.end());
+        {
+            std::lock_guard<std::mutex> ra_lock(ra_mutex_);
+            ra_pending_.erase(req.id);
+        }
+        ra_cv_.notify_all();
     }
-    else
+}
+
+void WAL::waitReadahead()
+{
+    std::unique_lock<std::mutex> lock(ra_mutex_);
+    ra_cv_.wait(lock, [this]
+                { return ra_stop_ || ra_pending_.empty(); });
+}
+
+void WAL::stopReadahead()
+{
+    {
+        std::lock_guard<std::mutex> lock(ra_mutex_);
+        ra_stop_ = true;
+        ra_queue_.clear();
+    }
+    ra_cv_.notify_all();
+    if (ra_thread_.joinable())
     {
-        // Binary format: varint length + data
-        std::vector<uint8_t> varint;
-        WriteVarint(data.size(), varint);
-        out.insert(out.end(), varint.begin(), varint.end());
-        out.insert(out.end(), data.begin(), data.end());
+        ra_thread_.join();
     }
+}
 
-    return {out, {pos, out.size()}};
+void WAL::clearCacheInternal()
+{
+    bcache_->Clear(); // 清除所有缓存的块
 }
 
-std::vector<uint8_t> WAL::readJSON(const std::vector<uint8_t> &edata)
+uint64_t WAL::NewSegmentId()
 {
-    try
-    {
-        std::string json_str(edata.begin(), edata.end());
-        size_t data_pos = json_str.find("\"data\":\"");
-        if (data_pos == std::string::npos)
-        {
-            throw std::runtime_error("invalid JSON format");
-        }
-        data_pos += 8; // length of "\"data\":\""
+    static std::atomic<uint64_t> next{1};
+    return next++;
+}
 
-        if (data_pos >= json_str.size())
-        {
-            throw std::runtime_error("invalid JSON format");
-        }
+std::string WAL::segmentName(uint64_t index)
+{
+    return SegmentName(index);
+}
 
-        char prefix = json_str[data_pos];
-        if (prefix != '+' && prefix != '$')
-        {
-            throw std::runtime_error("invalid data prefix");
-        }
+// BinaryV2 segment header, 32 bytes little endian: magic "\x89WALSEG\n",
+// u32 version (2), u32 record header size (12), u64 first index, u32
+// reserved, u32 CRC-32C of the bytes before it. A record is u32 length,
+// u32 flags, u32 CRC-32C of index, flags and payload, then the payload.
+static const uint8_t segment_magic[8] = {0x89, 'W', 'A', 'L', 'S', 'E', 'G', '\n'};
+static const size_t segment_header_size = wal_codec::BinaryV2::segment_header_size;
+
+std::string WAL::indexPath(const std::string &segment_path)
+{
+    return segment_path + ".idx";
+}
+
+std::string WAL::blobPath(const std::string &segment_path)
+{
+    return segment_path + ".blob";
+}
 
-        size_t end_pos = json_str.find('"', data_pos + 1);
-        if (end_pos == std::string::npos)
+std::string WAL::preallocPath(const std::string &segment_path)
+{
+    return segment_path + ".prealloc";
+}
+
+// Appends a large value to the tail's blob file and fills `ref` with the
+// reference the record stores instead.
+void WAL::appendBlob(const uint8_t *data, size_t size, uint8_t *ref)
+{
+    if (blob_fd_ < 0)
+    {
+        blob_fd_ = ::open(blobPath(segments_.back()->path).c_str(),
+                          O_WRONLY | O_CREAT | O_APPEND, options_.file_perms);
+        struct stat st;
+        if (blob_fd_ < 0 || ::fstat(blob_fd_, &st) != 0)
         {
-            throw std::runtime_error("invalid JSON format");
+            closeBlob();
+            throw std::runtime_error("failed to open blob file");
         }
+        blob_size_ = st.st_size;
+    }
 
-        std::string data_str = json_str.substr(data_pos + 1, end_pos - data_pos - 1);
-        if (prefix == '+')
+    uint64_t offset = blob_size_;
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = ::write(blob_fd_, data + done, size - done);
+        if (n < 0)
         {
-            return std::vector<uint8_t>(data_str.begin(), data_str.end());
+            // Whatever got written is never referenced; the size is read
+            // again on reopen
+            closeBlob();
+            throw std::runtime_error("failed to write blob file");
         }
-        else
+        done += n;
+    }
+    blob_size_ += size;
+    blob_dirty_ = true;
+
+    uint64_t len = size;
+    uint32_t crc = Crc32c(data, size);
+    std::memcpy(ref, &offset, 8);
+    std::memcpy(ref + 8, &len, 8);
+    std::memcpy(ref + 16, &crc, 4);
+}
+
+// Blob bytes go before the records that point at them
+void WAL::syncBlob()
+{
+    if (blob_fd_ >= 0 && blob_dirty_)
+    {
+        if (::fdatasync(blob_fd_) != 0)
         {
-            return base64_decode(data_str);
+            throw std::runtime_error("failed to sync blob file");
         }
+        blob_dirty_ = false;
     }
-    catch (...)
+}
+
+void WAL::closeBlob()
+{
+    if (blob_fd_ >= 0)
     {
-        throw std::runtime_error("log corrupt");
+        ::close(blob_fd_);
     }
+    blob_fd_ = -1;
+    blob_dirty_ = false;
 }
 
-std::vector<uint8_t> WAL::readBinary(const std::vector<uint8_t> &edata, bool no_copy)
+// Reads a value by reference with pread, bypassing the block cache so big
+// values do not push out the records around them. Returns false if the
+// blob is missing or does not match its CRC.
+bool WAL::readBlob(const std::string &segment_path, const std::vector<uint8_t> &ref,
+                   std::vector<uint8_t> *out)
 {
-    uint64_t size;
-    size_t n = ReadVarint(edata.data(), edata.size(), &size);
-    if (n == 0 || edata.size() - n < size)
+    if (ref.size() != blob_ref_size)
     {
-        throw std::runtime_error("log corrupt");
+        return false;
     }
+    uint64_t offset;
+    uint64_t len;
+    uint32_t crc;
+    std::memcpy(&offset, ref.data(), 8);
+    std::memcpy(&len, ref.data() + 8, 8);
+    std::memcpy(&crc, ref.data() + 16, 4);
 
-    if (no_copy)
+    int fd = ::open(blobPath(segment_path).c_str(), O_RDONLY);
+    if (fd < 0)
     {
-        return std::vector<uint8_t>(
-            edata.begin() + n,
-            edata.begin() + n + size);
+        return false;
     }
-    else
+    out->resize(len);
+    size_t done = 0;
+    while (done < len)
     {
-        std::vector<uint8_t> data(size);
-        std::copy(
-            edata.begin() + n,
-            edata.begin() + n + size,
-            data.begin());
-        return data;
+        ssize_t n = ::pread(fd, out->data() + done, len - done, offset + done);
+        if (n <= 0)
+        {
+            break;
+        }
+        done += n;
+    }
+    ::close(fd);
+    return done == len && Crc32c(out->data(), len) == crc;
+}
+
+std::vector<uint8_t> WAL::segmentHeader(uint64_t index)
+{
+    std::vector<uint8_t> header(segment_header_size, 0);
+    uint32_t version = 2;
+    uint32_t record_header = 12;
+    std::memcpy(header.data(), segment_magic, 8);
+    std::memcpy(header.data() + 8, &version, 4);
+    std::memcpy(header.data() + 12, &record_header, 4);
+    std::memcpy(header.data() + 16, &index, 8);
+    uint32_t crc = Crc32c(header.data(), 28);
+    std::memcpy(header.data() + 28, &crc, 4);
+    return header;
+}
+
+size_t WAL::segmentHeaderSize(LogFormat format)
+{
+    return format == LogFormat::BinaryV2 ? segment_header_size : 0;
+}
+
+// JSON logs are configured, not detected. A binary segment is v2 only if it
+// carries a well formed header for its own base index.
+WAL::LogFormat WAL::detectFormat(const std::vector<uint8_t> &buf, uint64_t index,
+                                 LogFormat configured)
+{
+    if (configured == LogFormat::JSON)
+    {
+        return LogFormat::JSON;
+    }
+    if (buf.size() >= segment_header_size &&
+        std::memcmp(buf.data(), segment_magic, 8) == 0)
+    {
+        std::vector<uint8_t> expect = segmentHeader(index);
+        if (std::equal(expect.begin(), expect.end(), buf.begin()))
+        {
+            return LogFormat::BinaryV2;
+        }
+    }
+    return LogFormat::Binary;
+}
+
+// Stamps the CRC of a v2 record whose length and payload are in place
+void WAL::sealRecord(uint8_t *record, uint64_t index)
+{
+    wal_codec::BinaryV2::Seal(record, index);
+}
+
+// A fresh segment takes the configured format; v2 ones get their header.
+void WAL::initSegment(Segment &seg, std::ostream &out)
+{
+    seg.format = options_.log_format;
+    seg.ebuf.clear();
+    seg.epos.clear();
+    seg.meta.clear();
+    seg.meta_loaded = true;
+    if (seg.format == LogFormat::BinaryV2)
+    {
+        seg.ebuf = segmentHeader(seg.index);
+        if (!out.write(reinterpret_cast<const char *>(seg.ebuf.data()), seg.ebuf.size()) ||
+            !out.flush())
+        {
+            throw std::runtime_error("failed to write segment header");
+        }
     }
 }
 
+// Encodes one entry onto the end of dst and returns its position.
+std::pair<size_t, size_t>
+WAL::appendEntry(std::vector<uint8_t> &dst, uint64_t index,
+                 const uint8_t *data, size_t size, LogFormat format,
+                 const EntryMeta &meta)
+{
+    size_t pos = dst.size();
+    wal_codec::WithCodec(format, [&](auto codec)
+                         { decltype(codec)::Append(dst, index, data, size, 0, meta); });
+    return {pos, dst.size()};
+}
+
+std::vector<uint8_t> WAL::readEntry(const uint8_t *edata, size_t esize,
+                                    uint64_t index, LogFormat format, uint32_t *flags,
+                                    EntryMeta *meta)
+{
+    return wal_codec::WithCodec(format, [&](auto codec)
+                                { return decltype(codec)::Decode(edata, esize, index, flags,
+                                                                 meta); });
+}
+
 void WAL::Batch::Write(uint64_t index, const std::vector<uint8_t> &data)
 {
-    entries.push_back({index, data.size()});
-    datas.insert(datas.end(), data.begin(), data.end());
+    Write(index, data.data(), data.size());
+}
+
+void WAL::Batch::Write(uint64_t index, std::vector<uint8_t> &&data)
+{
+    if (datas.empty())
+    {
+        // The first payload can become the batch buffer as is
+        entries.push_back({index, data.size()});
+        datas = std::move(data);
+        return;
+    }
+    Write(index, data.data(), data.size());
+}
+
+void WAL::Batch::Write(uint64_t index, const uint8_t *data, size_t size)
+{
+    entries.push_back({index, size});
+    datas.insert(datas.end(), data, data + size);
+}
+
+void WAL::Batch::Write(uint64_t index, const uint8_t *data, size_t size,
+                       const EntryMeta &meta)
+{
+    entries.push_back({index, size, meta});
+    datas.insert(datas.end(), data, data + size);
 }
 
 void WAL::Batch::Clear()
@@ -1126,7 +3103,8 @@ void WAL::PrintSegmentInfo()
     std::cout << "First Index: " << first_index_ << std::endl;
     std::cout << "Last Index: " << last_index_ << std::endl;
     std::cout << "Total Segments: " << segments_.size() << std::endl;
-    std::cout << "Segment Cache Size: " << scache_.size() << std::endl;
+    std::cout << "Block Cache: " << bcache_->Usage() << " / " << bcache_->Capacity()
+              << " bytes" << std::endl;
     std::cout << "Corrupt: " << (corrupt_ ? "Yes" : "No") << std::endl;
     std::cout << "Closed: " << (closed_ ? "Yes" : "No") << std::endl;
     std::cout << "Current Segment File: " << (sfile_ ? segments_.back()->path : "None") << std::endl;
@@ -1149,35 +3127,19 @@ void WAL::PrintSegmentInfo()
             std::cout << "  Last Entry Position: [" << seg->epos.back().first
                       << ", " << seg->epos.back().second << "]" << std::endl;
         }
-
-        // Print cache status
-        bool in_cache = false;
-        this->scache_.for_each([&seg, &in_cache](int idx, const std::shared_ptr<Segment> &cached_seg)
-                               {
-                                   (void)idx;
-                                   if (cached_seg == seg)
-                                   {
-                                       in_cache = true;
-                                       return false; // 终止遍历
-                                   }
-                                   return true; // 继续遍历
-                               });
-        std::cout << "  In Cache: " << (in_cache ? "Yes" : "No") << std::endl;
-    }
-
-    std::cout << "\n===== Cache Information =====" << std::endl;
-    std::cout << "Cached Segments (LRU order): ";
-    scache_.for_each([&](int seg_idx, const std::shared_ptr<Segment> & /*seg*/)
-                     {
-                         std::cout << seg_idx << " ";
-                         return true; // 继续遍历所有项
-                     });
-    std::cout << std::endl;
+        std::cout << "  Block Cache Id: " << seg->id << std::endl;
+    }
 
     std::cout << "\n===== Options =====" << std::endl;
     std::cout << "Segment Size: " << options_.segment_size << " bytes" << std::endl;
     std::cout << "Segment Cache Size: " << options_.segment_cache_size << std::endl;
-    std::cout << "Log Format: " << (options_.log_format == LogFormat::JSON ? "JSON" : "Binary") << std::endl;
+    std::cout << "Cold Dir: " << (cold_path_.empty() ? "None" : cold_path_) << std::endl;
+    std::cout << "Block Cache Size: " << options_.block_cache_size << " bytes" << std::endl;
+    std::cout << "Log Format: "
+              << (options_.log_format == LogFormat::JSON       ? "JSON"
+                  : options_.log_format == LogFormat::BinaryV2 ? "Binary v2"
+                                                               : "Binary")
+              << std::endl;
     std::cout << "No Copy: " << (options_.no_copy ? "Yes" : "No") << std::endl;
     std::cout << "No Sync: " << (options_.no_sync ? "Yes" : "No") << std::endl;
     std::cout << "Directory Permissions: " << std::oct << options_.dir_perms << std::dec << std::endl;
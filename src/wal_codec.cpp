@@ -0,0 +1,278 @@
+#include "wal_codec.h"
+
+#include <algorithm>
+
+namespace wal_codec
+{
+    bool Binary::Scan(const uint8_t *p, size_t size, size_t max_entries, Positions &epos)
+    {
+        size_t base = epos.size();
+
+        // Sealed segments know their entry count up front
+        if (max_entries != SIZE_MAX)
+        {
+            epos.resize(base + max_entries);
+        }
+        else
+        {
+            epos.resize(base + size / 16 + 1);
+        }
+
+        size_t n = base;
+        size_t pos = 0;
+        while (pos < size && n - base < max_entries)
+        {
+            // Lengths below 16 KiB take the one or two byte fast path
+            uint64_t data_size;
+            size_t varint_len;
+            uint8_t b0 = p[pos];
+            if (b0 < 0x80)
+            {
+                data_size = b0;
+                varint_len = 1;
+            }
+            else if (pos + 1 < size && p[pos + 1] < 0x80)
+            {
+                data_size = (b0 & 0x7f) | (static_cast<uint64_t>(p[pos + 1]) << 7);
+                varint_len = 2;
+            }
+            else
+            {
+                varint_len = ReadVarint(p + pos, size - pos, &data_size);
+                if (varint_len == 0)
+                {
+                    epos.resize(n);
+                    return false;
+                }
+            }
+            if (size - pos - varint_len < data_size)
+            {
+                epos.resize(n);
+                return false;
+            }
+
+            size_t end = pos + varint_len + data_size;
+            if (n == epos.size())
+            {
+                epos.resize(n + n / 2 + 16);
+            }
+            epos[n++] = {pos, end};
+            pos = end;
+        }
+        epos.resize(n);
+        return true;
+    }
+
+    std::vector<uint8_t> Binary::Decode(const uint8_t *edata, size_t esize, uint64_t,
+                                        uint32_t *flags, WAL::EntryMeta *meta)
+    {
+        if (flags)
+        {
+            *flags = 0;
+        }
+        if (meta)
+        {
+            *meta = {};
+        }
+        uint64_t size;
+        size_t n = ReadVarint(edata, esize, &size);
+        if (n == 0 || esize - n < size)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        return std::vector<uint8_t>(edata + n, edata + n + size);
+    }
+
+    bool BinaryV2::Scan(const uint8_t *p, size_t size, size_t max_entries, Positions &epos)
+    {
+        size_t base = epos.size();
+
+        // Fixed record headers: each boundary is one load and one add away
+        if (max_entries != SIZE_MAX)
+        {
+            epos.reserve(base + max_entries);
+        }
+        size_t pos = segment_header_size;
+        if (size < pos)
+        {
+            return false;
+        }
+        while (size - pos >= record_header_size && epos.size() - base < max_entries)
+        {
+            uint32_t len;
+            std::memcpy(&len, p + pos, 4);
+            if (size - pos - record_header_size < len)
+            {
+                return false;
+            }
+            epos.emplace_back(pos, pos + record_header_size + len);
+            pos += record_header_size + len;
+        }
+        return pos == size || epos.size() - base == max_entries;
+    }
+
+    std::vector<uint8_t> BinaryV2::Decode(const uint8_t *edata, size_t esize, uint64_t index,
+                                          uint32_t *flags, WAL::EntryMeta *meta)
+    {
+        if (esize < record_header_size)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        uint32_t len;
+        uint32_t crc;
+        std::memcpy(&len, edata, 4);
+        std::memcpy(&crc, edata + 8, 4);
+        if (esize - record_header_size != len)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+
+        if (RecordCrc(edata, index) != crc)
+        {
+            throw std::runtime_error("log corrupt: checksum mismatch at index " +
+                                     std::to_string(index));
+        }
+        if (flags)
+        {
+            std::memcpy(flags, edata + 4, 4);
+        }
+        WAL::EntryMeta m;
+        size_t skip = DecodeMeta(edata, esize, &m) ? meta_size : 0;
+        if (meta)
+        {
+            *meta = m;
+        }
+        return std::vector<uint8_t>(edata + record_header_size + skip, edata + esize);
+    }
+
+    bool BinaryV2::DecodeMeta(const uint8_t *edata, size_t esize, WAL::EntryMeta *meta)
+    {
+        uint32_t flags;
+        std::memcpy(&flags, edata + 4, 4);
+        if (!(flags & meta_flag))
+        {
+            *meta = {};
+            return false;
+        }
+        if (esize < record_header_size + meta_size)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        std::memcpy(&meta->term, edata + record_header_size, 8);
+        std::memcpy(&meta->type, edata + record_header_size + 8, 4);
+        return true;
+    }
+
+    uint32_t BinaryV2::RecordCrc(const uint8_t *record, uint64_t index)
+    {
+        uint32_t len;
+        std::memcpy(&len, record, 4);
+        uint8_t prefix[12];
+        std::memcpy(prefix, &index, 8);
+        std::memcpy(prefix + 8, record + 4, 4);
+        return Crc32c(record + record_header_size, len, Crc32c(prefix, sizeof(prefix)));
+    }
+
+    bool Json::Scan(const uint8_t *p, size_t size, size_t max_entries, Positions &epos)
+    {
+        size_t base = epos.size();
+
+        // Every record ends in a newline, so one vectorized count sizes the
+        // offset table exactly and memchr finds each boundary.
+        size_t lines = std::min(CountByte(p, size, '\n'), max_entries);
+        epos.resize(base + lines);
+        auto *out = epos.data() + base;
+
+        size_t pos = 0;
+        for (size_t n = 0; n < lines; n++)
+        {
+            const uint8_t *nl = static_cast<const uint8_t *>(
+                std::memchr(p + pos, '\n', size - pos));
+            size_t end = nl - p + 1;
+            out[n] = {pos, end};
+            pos = end;
+        }
+        // Bytes after the last newline are a torn record
+        return lines == max_entries || pos == size;
+    }
+
+    // Decodes in place: the payload is located by pointer and either copied
+    // out or base64 decoded straight from the record.
+    std::vector<uint8_t> Json::Decode(const uint8_t *edata, size_t esize, uint64_t,
+                                      uint32_t *flags, WAL::EntryMeta *meta)
+    {
+        static const char key[] = "\"data\":\"";
+        const uint8_t *end = edata + esize;
+        const uint8_t *at = std::search(edata, end, key, key + 8);
+        if (at == end || end - at <= 8)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        at += 8;
+
+        uint8_t prefix = *at++;
+        if (prefix != '+' && prefix != '$' && prefix != '@')
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        if (flags || meta)
+        {
+            WAL::EntryMeta m;
+            bool has_meta = DecodeMeta(edata, esize, &m);
+            if (flags)
+            {
+                *flags = (prefix == '@' ? blob_flag : 0) | (has_meta ? meta_flag : 0);
+            }
+            if (meta)
+            {
+                *meta = m;
+            }
+        }
+        const uint8_t *quote = static_cast<const uint8_t *>(
+            std::memchr(at, '"', end - at));
+        if (!quote)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+
+        if (prefix == '+')
+        {
+            return std::vector<uint8_t>(at, quote);
+        }
+        return base64_decode(at, quote - at);
+    }
+
+    // The fields follow the index right after the 10 byte record head
+    bool Json::DecodeMeta(const uint8_t *edata, size_t esize, WAL::EntryMeta *meta)
+    {
+        static const char term[] = "\",\"term\":\"";
+        static const char type[] = "\",\"type\":\"";
+        *meta = {};
+        const char *p = reinterpret_cast<const char *>(edata);
+        const char *end = p + esize;
+        if (esize < 10)
+        {
+            return false;
+        }
+        p += 10;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            p++;
+        }
+        if (end - p < 10 || std::memcmp(p, term, 10) != 0)
+        {
+            return false;
+        }
+        auto r = std::from_chars(p + 10, end, meta->term);
+        if (r.ec != std::errc() || end - r.ptr < 10 || std::memcmp(r.ptr, type, 10) != 0)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        r = std::from_chars(r.ptr + 10, end, meta->type);
+        if (r.ec != std::errc())
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        return true;
+    }
+}
@@ -0,0 +1,282 @@
+#include "wal.h"
+#include "wal_codec.h"
+#include "utils.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+namespace
+{
+    // One source segment re-encoded in the target format
+    struct Converted
+    {
+        uint64_t index = 0;           // index of the first entry in buf
+        std::vector<uint8_t> buf;
+        std::vector<size_t> ends;     // end offset of every entry
+    };
+
+    void writeAll(int fd, const uint8_t *data, size_t size)
+    {
+        while (size > 0)
+        {
+            ssize_t n = ::write(fd, data, size);
+            if (n < 0)
+            {
+                throw std::runtime_error("failed to write segment file");
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    // Atomically trades the names of two directories. Kernels and
+    // filesystems without RENAME_EXCHANGE fall back to two renames.
+    void swapDirs(const fs::path &a, const fs::path &b)
+    {
+#ifdef SYS_renameat2
+        if (::syscall(SYS_renameat2, AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(),
+                      RENAME_EXCHANGE) == 0)
+        {
+            return;
+        }
+#endif
+        fs::path old = b.string() + ".old";
+        fs::remove_all(old);
+        fs::rename(b, old);
+        fs::rename(a, b);
+        fs::rename(old, a);
+    }
+}
+
+// Re-encodes `threads` source segments at a time, packs them in order into
+// segments of `to.segment_size` next to the log and swaps the directories.
+void WAL::Convert(const std::string &path, const Options &from,
+                  const Options &to, size_t threads)
+{
+    if (!fs::is_directory(path))
+    {
+        throw std::runtime_error("log not found");
+    }
+    Options src_opts = from;
+    src_opts.readahead = false;
+    WAL src(path, src_opts);
+    src.stopTiering(); // Segment paths must hold still while they are read
+
+    Options dst_opts = to;
+    if (dst_opts.segment_size == 0)
+    {
+        dst_opts.segment_size = DefaultOptions.segment_size;
+    }
+    if (dst_opts.dir_perms == 0)
+    {
+        dst_opts.dir_perms = DefaultOptions.dir_perms;
+    }
+    if (dst_opts.file_perms == 0)
+    {
+        dst_opts.file_perms = DefaultOptions.file_perms;
+    }
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    fs::path dst_path = src.path_ + ".convert";
+    fs::remove_all(dst_path);
+    fs::create_directories(dst_path);
+    fs::permissions(dst_path, static_cast<fs::perms>(dst_opts.dir_perms));
+
+    uint64_t first = src.first_index_;
+    uint64_t last = src.last_index_;
+    const auto &segs = src.segments_;
+
+    auto convert = [&](size_t i, Converted &out)
+    {
+        auto seg = segs[i];
+        bool tail = i + 1 == segs.size();
+        if (!tail)
+        {
+            seg->ebuf.clear();
+            seg->epos.clear();
+            src.loadSegmentEntries(seg, segs[i + 1]->index - seg->index);
+        }
+
+        uint64_t skip = first > seg->index ? first - seg->index : 0;
+        out.index = seg->index + skip;
+        out.buf.clear();
+        out.ends.clear();
+        out.buf.reserve(seg->ebuf.size());
+        for (size_t e = skip; e < seg->epos.size(); e++)
+        {
+            const uint8_t *edata = seg->ebuf.data() + seg->epos[e].first;
+            size_t esize = seg->epos[e].second - seg->epos[e].first;
+            uint64_t index = seg->index + e;
+            if (seg->format == LogFormat::Binary)
+            {
+                // Skip the decode copy for the plain varint layout
+                uint64_t size;
+                size_t n = ReadVarint(edata, esize, &size);
+                if (n == 0 || esize - n < size)
+                {
+                    throw std::runtime_error("log corrupt: first bad index " +
+                                             std::to_string(index));
+                }
+                appendEntry(out.buf, index, edata + n, size, dst_opts.log_format,
+                            EntryMeta{});
+            }
+            else
+            {
+                uint32_t flags;
+                EntryMeta meta;
+                std::vector<uint8_t> data = readEntry(edata, esize, index, seg->format, &flags,
+                                                      &meta);
+                if (flags & wal_codec::blob_flag)
+                {
+                    // Values come back inline; the output has no blob files
+                    std::vector<uint8_t> ref = std::move(data);
+                    if (!readBlob(seg->path, ref, &data))
+                    {
+                        throw std::runtime_error("log corrupt: first bad index " +
+                                                 std::to_string(index));
+                    }
+                }
+                appendEntry(out.buf, index, data.data(), data.size(), dst_opts.log_format, meta);
+            }
+            out.ends.push_back(out.buf.size());
+        }
+        if (!tail)
+        {
+            seg->ebuf = std::vector<uint8_t>();
+            seg->epos = std::vector<std::pair<size_t, size_t>>();
+        }
+    };
+
+    // Output segment being filled
+    std::vector<uint64_t> written;
+    int fd = -1;
+    size_t fill = 0;
+    auto closeOutput = [&]()
+    {
+        if (fd >= 0)
+        {
+            bool ok = ::fsync(fd) == 0;
+            ::close(fd);
+            fd = -1;
+            if (!ok)
+            {
+                throw std::runtime_error("failed to sync segment file");
+            }
+        }
+    };
+    auto openOutput = [&](uint64_t index)
+    {
+        fs::path p = dst_path / segmentName(index);
+        fd = ::open(p.c_str(), O_WRONLY | O_CREAT | O_TRUNC, dst_opts.file_perms);
+        if (fd < 0)
+        {
+            throw std::runtime_error("failed to create segment file");
+        }
+        written.push_back(index);
+        fill = 0;
+        if (dst_opts.log_format == LogFormat::BinaryV2)
+        {
+            std::vector<uint8_t> header = segmentHeader(index);
+            writeAll(fd, header.data(), header.size());
+            fill = header.size();
+        }
+    };
+
+    try
+    {
+        std::vector<Converted> window(std::min(threads, segs.size()));
+        for (size_t base = 0; base < segs.size(); base += window.size())
+        {
+            size_t count = std::min(window.size(), segs.size() - base);
+            RunParallel(count, [&](size_t w)
+                        { convert(base + w, window[w]); });
+
+            // Pack in index order, cutting where the writer would have cycled
+            for (size_t w = 0; w < count; w++)
+            {
+                const Converted &c = window[w];
+                size_t start = 0;
+                for (size_t e = 0; e < c.ends.size(); e++)
+                {
+                    if (fd < 0)
+                    {
+                        openOutput(c.index + e);
+                    }
+                    fill += c.ends[e] - (e == 0 ? 0 : c.ends[e - 1]);
+                    if (fill >= dst_opts.segment_size)
+                    {
+                        writeAll(fd, c.buf.data() + start, c.ends[e] - start);
+                        start = c.ends[e];
+                        closeOutput();
+                    }
+                }
+                if (fd >= 0 && start < c.buf.size())
+                {
+                    writeAll(fd, c.buf.data() + start, c.buf.size() - start);
+                }
+            }
+        }
+        if (written.empty() || fd < 0)
+        {
+            // Keep a tail for new writes even if the log is empty or ends on
+            // a full segment
+            openOutput(last + 1);
+        }
+        closeOutput();
+
+        std::string snap = "WAL-MANIFEST 1\n";
+        for (uint64_t index : written)
+        {
+            snap += "add=" + std::to_string(index) + " ";
+        }
+        snap += "front=" + std::to_string(first) + "\n";
+        fd = ::open((dst_path / "MANIFEST").c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                    dst_opts.file_perms);
+        if (fd < 0)
+        {
+            throw std::runtime_error("failed to create manifest");
+        }
+        writeAll(fd, reinterpret_cast<const uint8_t *>(snap.data()), snap.size());
+        closeOutput();
+        SyncPath(dst_path.string());
+    }
+    catch (...)
+    {
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        std::error_code ec;
+        fs::remove_all(dst_path, ec);
+        throw;
+    }
+
+    src.Close();
+    swapDirs(dst_path, src.path_);
+    SyncPath(fs::path(src.path_).parent_path().string());
+    fs::remove_all(dst_path);
+
+    // The converted log is all in the hot directory
+    for (const auto &seg : segs)
+    {
+        if (src.isCold(*seg))
+        {
+            std::error_code ec;
+            fs::remove(seg->path, ec);
+            fs::remove(indexPath(seg->path), ec);
+            fs::remove(blobPath(seg->path), ec);
+        }
+    }
+}
@@ -0,0 +1,308 @@
+#include "wal.h"
+#include "utils.h"
+#include "wal_codec.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+namespace
+{
+    // Moves `len` bytes at `off` of `in` to `out` inside the kernel:
+    // copy_file_range between files, sendfile to sockets and pipes, and
+    // read/write where neither is supported.
+    void sendRange(int in, uint64_t off, uint64_t len, int out)
+    {
+        bool copy_range = true;
+        bool send_file = true;
+        std::vector<uint8_t> buf;
+        while (len > 0)
+        {
+            ssize_t n;
+            if (copy_range)
+            {
+                loff_t at = static_cast<loff_t>(off);
+                n = ::copy_file_range(in, &at, out, nullptr, len, 0);
+                if (n < 0 && (errno == EINVAL || errno == EXDEV || errno == EBADF ||
+                              errno == ENOSYS || errno == EOPNOTSUPP))
+                {
+                    copy_range = false;
+                    continue;
+                }
+            }
+            else if (send_file)
+            {
+                off_t at = static_cast<off_t>(off);
+                n = ::sendfile(out, in, &at, len);
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+                {
+                    send_file = false;
+                    continue;
+                }
+            }
+            else
+            {
+                buf.resize(std::min<uint64_t>(len, 1 << 16));
+                n = ::pread(in, buf.data(), buf.size(), static_cast<off_t>(off));
+                for (ssize_t done = 0; n > 0 && done < n;)
+                {
+                    ssize_t w = ::write(out, buf.data() + done, n - done);
+                    if (w < 0 && errno != EINTR)
+                    {
+                        throw std::runtime_error("failed to export range");
+                    }
+                    done += w < 0 ? 0 : w;
+                }
+            }
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::runtime_error("failed to export range");
+            }
+            if (n == 0)
+            {
+                // Cut by a back truncation after the range was resolved
+                throw std::runtime_error("entry truncated");
+            }
+            off += n;
+            len -= n;
+        }
+    }
+}
+
+// Byte range of entries [a, b] of a segment, from its offsets in memory or
+// its offset index. False if the index is missing or does not fit.
+bool WAL::entryRange(const Segment &seg, size_t a, size_t b, LogFormat *format,
+                     uint64_t *start, uint64_t *end)
+{
+    if (b < seg.epos.size())
+    {
+        *format = seg.format;
+        *start = seg.epos[a].first;
+        *end = seg.epos[b].second;
+        return true;
+    }
+
+    std::string ipath = indexPath(seg.path);
+    uint64_t file = seg.id * 2 + 1;
+    std::vector<uint8_t> raw;
+    if (!readRange(ipath, file, 0, 16, &raw) || std::memcmp(raw.data(), "WALIDX1\n", 8) != 0)
+    {
+        return false;
+    }
+    uint32_t f;
+    std::memcpy(&f, raw.data() + 8, 4);
+    *format = static_cast<LogFormat>(f);
+    if (a == 0)
+    {
+        *start = segmentHeaderSize(*format);
+    }
+    else
+    {
+        if (!readRange(ipath, file, 16 + (a - 1) * 8, 16 + a * 8, &raw))
+        {
+            return false;
+        }
+        std::memcpy(start, raw.data(), 8);
+    }
+    if (!readRange(ipath, file, 16 + b * 8, 16 + (b + 1) * 8, &raw))
+    {
+        return false;
+    }
+    std::memcpy(end, raw.data(), 8);
+    return *start <= *end;
+}
+
+// True if one of the records in [start, end) of a segment file, the first
+// being entry `index`, keeps its value in the segment's blob file
+bool WAL::rangeHasBlobs(int fd, uint64_t start, uint64_t end, uint64_t index,
+                        LogFormat format)
+{
+    if (format == LogFormat::Binary)
+    {
+        return false; // no flags, so never a blob
+    }
+    std::vector<uint8_t> buf(end - start);
+    for (size_t got = 0; got < buf.size();)
+    {
+        ssize_t n = ::pread(fd, buf.data() + got, buf.size() - got,
+                            static_cast<off_t>(start + got));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            throw std::runtime_error("entry truncated");
+        }
+        got += n;
+    }
+
+    std::vector<std::pair<size_t, size_t>> epos;
+    if (format == LogFormat::BinaryV2)
+    {
+        // Scan expects a segment header in front; the range starts at a record
+        const size_t header = wal_codec::BinaryV2::record_header_size;
+        for (size_t pos = 0; buf.size() - pos >= header;)
+        {
+            uint32_t len;
+            std::memcpy(&len, buf.data() + pos, 4);
+            if (buf.size() - pos - header < len)
+            {
+                break;
+            }
+            epos.emplace_back(pos, pos + header + len);
+            pos += header + len;
+        }
+    }
+    else
+    {
+        scanEntries(buf, format, SIZE_MAX, epos);
+    }
+    if (epos.empty() || epos.back().second != buf.size())
+    {
+        throw std::runtime_error("entry truncated");
+    }
+
+    for (size_t e = 0; e < epos.size(); e++)
+    {
+        uint32_t flags = 0;
+        readEntry(buf.data() + epos[e].first, epos[e].second - epos[e].first, index + e,
+                  format, &flags);
+        if (flags & wal_codec::blob_flag)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Byte ranges are resolved and their files opened under the lock, so front
+// truncation or tiering can't pull them away; the copy runs without it. A
+// back truncation cuts files in place, so one that raced the copy fails it.
+uint64_t WAL::ExportRange(uint64_t from, uint64_t to, int fd)
+{
+    struct Piece
+    {
+        int fd;
+        uint64_t start;
+        uint64_t end;
+        uint64_t index; // of the first record
+        bool blobs;     // the segment has a blob file
+    };
+    LogFormat format = LogFormat::Binary;
+    std::vector<Piece> pieces;
+    uint64_t gen = 0;
+    auto closePieces = [&]()
+    {
+        for (const auto &p : pieces)
+        {
+            ::close(p.fd);
+        }
+        pieces.clear();
+    };
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (corrupt_)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        if (closed_)
+        {
+            throw std::runtime_error("log closed");
+        }
+        if (from == 0 || from > to || from < first_index_ || to > last_index_)
+        {
+            throw std::runtime_error("not found");
+        }
+        if (!sfile_->flush())
+        {
+            corrupt_ = true;
+            throw std::runtime_error("failed to write to segment file");
+        }
+        gen = cut_gen_.load();
+
+        uint64_t index = from;
+        for (int i = findSegment(from); index <= to; i++)
+        {
+            auto seg = segments_[i];
+            bool tail = i + 1 == static_cast<int>(segments_.size());
+            uint64_t seg_last = tail ? last_index_ : segments_[i + 1]->index - 1;
+            uint64_t stop = std::min(seg_last, to);
+            LogFormat seg_format;
+            uint64_t start, end;
+            size_t a = index - seg->index;
+            size_t b = stop - seg->index;
+            if (!entryRange(*seg, a, b, &seg_format, &start, &end))
+            {
+                rebuildSegmentIndex(i);
+                if (!entryRange(*seg, a, b, &seg_format, &start, &end))
+                {
+                    throw std::runtime_error("log corrupt");
+                }
+            }
+            // The output is one run of records in one format
+            if (index != from && seg_format != format)
+            {
+                throw std::runtime_error("range spans segment formats");
+            }
+            format = seg_format;
+
+            int in = ::open(seg->path.c_str(), O_RDONLY);
+            if (in < 0)
+            {
+                throw std::runtime_error("failed to open segment file");
+            }
+            pieces.push_back({in, start, end, index, fs::exists(blobPath(seg->path))});
+            index = stop + 1;
+        }
+    }
+    catch (...)
+    {
+        closePieces();
+        throw;
+    }
+
+    uint64_t total = 0;
+    try
+    {
+        // Only segments with a blob file have their records read, and only
+        // the exported ones, before anything is sent
+        for (const auto &p : pieces)
+        {
+            if (p.blobs && rangeHasBlobs(p.fd, p.start, p.end, p.index, format))
+            {
+                throw std::runtime_error("range has blob values");
+            }
+        }
+        for (const auto &p : pieces)
+        {
+            sendRange(p.fd, p.start, p.end - p.start, fd);
+            total += p.end - p.start;
+        }
+    }
+    catch (...)
+    {
+        closePieces();
+        if (cut_gen_.load() != gen)
+        {
+            throw std::runtime_error("entry truncated");
+        }
+        throw;
+    }
+    closePieces();
+    // The bytes sent may mix records from before and after the cut
+    if (cut_gen_.load() != gen)
+    {
+        throw std::runtime_error("entry truncated");
+    }
+    return total;
+}
@@ -0,0 +1,595 @@
+#include "wal_group.h"
+#include "utils.h"
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <filesystem>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+const WALGroup::Options WALGroup::DefaultOptions{};
+
+WALGroup::SegmentFile::~SegmentFile()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+WALGroup::WALGroup(const std::string &path, const Options &options)
+    : path_(fs::absolute(path).string()), options_(options)
+{
+    if (options_.segment_size == 0)
+    {
+        options_.segment_size = DefaultOptions.segment_size;
+    }
+    if (options_.file_perms == 0)
+    {
+        options_.file_perms = DefaultOptions.file_perms;
+    }
+
+    fs::create_directories(path_);
+
+    this->load();
+}
+
+WALGroup::~WALGroup()
+{
+    Close();
+}
+
+void WALGroup::Write(uint64_t log, uint64_t index, const std::vector<uint8_t> &data)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    checkOpen();
+
+    auto it = logs_.find(log);
+    uint64_t next_last = it == logs_.end() ? 0 : it->second.next_last;
+    if (index != next_last + 1)
+    {
+        throw std::runtime_error("out of order");
+    }
+    logs_[log].next_last = index;
+
+    uint64_t seq = enqueue(Append, log, index, data.data(), data.size());
+    commit(lock, seq);
+}
+
+void WALGroup::WriteBatch(uint64_t log, WAL::Batch *batch)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    checkOpen();
+    if (batch->entries.empty())
+    {
+        return;
+    }
+
+    // Check indexes are sequential
+    auto it = logs_.find(log);
+    uint64_t next_last = it == logs_.end() ? 0 : it->second.next_last;
+    for (size_t i = 0; i < batch->entries.size(); i++)
+    {
+        if (batch->entries[i].index != next_last + i + 1)
+        {
+            throw std::runtime_error("out of order");
+        }
+    }
+    logs_[log].next_last = batch->entries.back().index;
+
+    uint64_t seq = 0;
+    size_t data_pos = 0;
+    for (const auto &entry : batch->entries)
+    {
+        seq = enqueue(Append, log, entry.index,
+                      batch->datas.data() + data_pos, entry.size);
+        data_pos += entry.size;
+    }
+    commit(lock, seq);
+
+    batch->Clear();
+}
+
+std::vector<uint8_t> WALGroup::Read(uint64_t log, uint64_t index)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    checkOpen();
+
+    auto it = logs_.find(log);
+    if (it == logs_.end() || index == 0 || index < it->second.first_index ||
+        index - it->second.first_index >= it->second.entries.size())
+    {
+        throw std::runtime_error("not found");
+    }
+
+    // The location holds its segment open, so the read can run unlocked
+    Location loc = it->second.entries[index - it->second.first_index];
+    lock.unlock();
+
+    std::vector<uint8_t> data(loc.size);
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t n = ::pread(loc.seg->fd, data.data() + done, data.size() - done,
+                            loc.offset + done);
+        if (n <= 0)
+        {
+            throw std::runtime_error("failed to read segment file");
+        }
+        done += n;
+    }
+    return data;
+}
+
+uint64_t WALGroup::FirstIndex(uint64_t log)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkOpen();
+    auto it = logs_.find(log);
+    if (it == logs_.end() || it->second.entries.empty())
+    {
+        return 0;
+    }
+    return it->second.first_index;
+}
+
+uint64_t WALGroup::LastIndex(uint64_t log)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkOpen();
+    auto it = logs_.find(log);
+    if (it == logs_.end() || it->second.entries.empty())
+    {
+        return 0;
+    }
+    return it->second.first_index + it->second.entries.size() - 1;
+}
+
+void WALGroup::TruncateFront(uint64_t log, uint64_t index)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    checkOpen();
+
+    auto it = logs_.find(log);
+    if (it == logs_.end() || index == 0 || it->second.next_last == 0 ||
+        index < it->second.next_first || index > it->second.next_last)
+    {
+        throw std::runtime_error("out of range");
+    }
+    if (index == it->second.next_first)
+    {
+        return;
+    }
+    it->second.next_first = index;
+
+    uint64_t seq = enqueue(Front, log, index, nullptr, 0);
+    commit(lock, seq);
+}
+
+void WALGroup::TruncateBack(uint64_t log, uint64_t index)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    checkOpen();
+
+    auto it = logs_.find(log);
+    if (it == logs_.end() || index == 0 || it->second.next_last == 0 ||
+        index < it->second.next_first || index > it->second.next_last)
+    {
+        throw std::runtime_error("out of range");
+    }
+    if (index == it->second.next_last)
+    {
+        return;
+    }
+    it->second.next_last = index;
+
+    uint64_t seq = enqueue(Back, log, index, nullptr, 0);
+    commit(lock, seq);
+}
+
+std::vector<uint64_t> WALGroup::Logs()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    checkOpen();
+    std::vector<uint64_t> ids;
+    for (const auto &[id, l] : logs_)
+    {
+        if (!l.entries.empty())
+        {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+void WALGroup::Sync()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    checkOpen();
+    commit(lock, pending_seq_);
+    cv_.wait(lock, [this]
+             { return !committing_; });
+    if (active_ && !options_.no_sync && ::fdatasync(active_->fd) != 0)
+    {
+        corrupt_ = true;
+        throw std::runtime_error("failed to sync segment file");
+    }
+}
+
+void WALGroup::Close()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (closed_)
+    {
+        if (corrupt_)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        return;
+    }
+
+    if (!corrupt_)
+    {
+        commit(lock, pending_seq_);
+    }
+    cv_.wait(lock, [this]
+             { return !committing_; });
+    if (active_ && !options_.no_sync && !corrupt_ && ::fdatasync(active_->fd) != 0)
+    {
+        corrupt_ = true;
+    }
+
+    closed_ = true;
+    logs_.clear();
+    segments_.clear();
+    active_.reset();
+    if (corrupt_)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+}
+
+// Private methods
+void WALGroup::load()
+{
+    std::vector<uint64_t> ids;
+    for (const auto &entry : fs::directory_iterator(path_))
+    {
+        std::string name = entry.path().filename().string();
+        if (!entry.is_regular_file() || name.size() != 20 ||
+            !std::all_of(name.begin(), name.end(), [](unsigned char c)
+                         { return std::isdigit(c) != 0; }))
+        {
+            continue;
+        }
+        ids.push_back(std::stoull(name));
+    }
+    std::sort(ids.begin(), ids.end());
+
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+        auto seg = openSegment(ids[i], false);
+        segments_.push_back(seg);
+        replaySegment(seg, i + 1 == ids.size());
+    }
+
+    if (segments_.empty())
+    {
+        segments_.push_back(openSegment(1, true));
+    }
+    active_ = segments_.back();
+
+    for (auto it = logs_.begin(); it != logs_.end();)
+    {
+        auto &l = it->second;
+        if (l.entries.empty())
+        {
+            it = logs_.erase(it);
+            continue;
+        }
+        l.next_first = l.first_index;
+        l.next_last = l.first_index + l.entries.size() - 1;
+        ++it;
+    }
+
+    reclaimSegments();
+}
+
+/**
+ * Record layout: type byte, varint log, varint index and, for appends, a
+ * varint payload size followed by the payload. A record cut short at the
+ * end of the last segment is a torn write and is dropped.
+ */
+void WALGroup::replaySegment(const std::shared_ptr<SegmentFile> &seg, bool tail)
+{
+    std::vector<uint8_t> buf(seg->size);
+    if (!buf.empty() && ::pread(seg->fd, buf.data(), buf.size(), 0) !=
+                            static_cast<ssize_t>(buf.size()))
+    {
+        throw std::runtime_error("failed to read segment file");
+    }
+
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        size_t p = pos;
+        uint8_t type = buf[p++];
+        uint64_t log = 0, index = 0, size = 0;
+        size_t n;
+        bool ok = type == Append || type == Front || type == Back;
+        if (ok && (n = ReadVarint(buf.data() + p, buf.size() - p, &log)) != 0)
+        {
+            p += n;
+        }
+        else
+        {
+            ok = false;
+        }
+        if (ok && (n = ReadVarint(buf.data() + p, buf.size() - p, &index)) != 0)
+        {
+            p += n;
+        }
+        else
+        {
+            ok = false;
+        }
+        if (ok && type == Append)
+        {
+            n = ReadVarint(buf.data() + p, buf.size() - p, &size);
+            ok = n != 0 && buf.size() - p - n >= size;
+            p += n;
+        }
+
+        if (!ok)
+        {
+            if (!tail)
+            {
+                throw std::runtime_error("log corrupt");
+            }
+            if (::ftruncate(seg->fd, pos) != 0)
+            {
+                throw std::runtime_error("failed to truncate segment file");
+            }
+            break;
+        }
+
+        applyRecord(static_cast<RecordType>(type), log, index,
+                    {seg, p, static_cast<uint32_t>(size)});
+        pos = p + size;
+    }
+    seg->size = pos;
+}
+
+void WALGroup::applyRecord(RecordType type, uint64_t log, uint64_t index,
+                           const Location &loc)
+{
+    auto &l = logs_[log];
+    switch (type)
+    {
+    case Append:
+        if (l.entries.empty())
+        {
+            l.first_index = index;
+        }
+        else if (index != l.first_index + l.entries.size())
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        l.entries.push_back(loc);
+        loc.seg->live++;
+        break;
+    case Front:
+        while (!l.entries.empty() && l.first_index < index)
+        {
+            l.entries.front().seg->live--;
+            l.entries.pop_front();
+            l.first_index++;
+        }
+        break;
+    case Back:
+        while (!l.entries.empty() && l.first_index + l.entries.size() - 1 > index)
+        {
+            l.entries.back().seg->live--;
+            l.entries.pop_back();
+        }
+        break;
+    }
+}
+
+uint64_t WALGroup::enqueue(RecordType type, uint64_t log, uint64_t index,
+                           const uint8_t *data, size_t size)
+{
+    if (size > UINT32_MAX)
+    {
+        throw std::runtime_error("entry too large");
+    }
+
+    Record rec;
+    rec.type = type;
+    rec.log = log;
+    rec.index = index;
+    rec.start = pending_.size();
+
+    pending_.push_back(type);
+    WriteVarint(log, pending_);
+    WriteVarint(index, pending_);
+    if (type == Append)
+    {
+        WriteVarint(size, pending_);
+    }
+    rec.data = pending_.size();
+    pending_.insert(pending_.end(), data, data + size);
+    rec.end = pending_.size();
+
+    pending_recs_.push_back(rec);
+    return ++pending_seq_;
+}
+
+/**
+ * Group commit: the first caller that finds no commit in flight takes the
+ * whole queue, writes it with the lock released and syncs once. Everyone
+ * else waits until a commit covering their sequence number completes.
+ */
+void WALGroup::commit(std::unique_lock<std::mutex> &lock, uint64_t seq)
+{
+    while (durable_seq_ < seq)
+    {
+        if (corrupt_)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        if (committing_)
+        {
+            cv_.wait(lock);
+            continue;
+        }
+
+        committing_ = true;
+        std::vector<uint8_t> buf;
+        std::vector<Record> recs;
+        buf.swap(pending_);
+        recs.swap(pending_recs_);
+        uint64_t batch_seq = pending_seq_;
+        lock.unlock();
+
+        std::vector<Location> locs(recs.size());
+        std::vector<std::shared_ptr<SegmentFile>> opened;
+        bool ok = true;
+        try
+        {
+            writeRecords(buf, recs, locs, opened);
+        }
+        catch (...)
+        {
+            ok = false;
+        }
+
+        lock.lock();
+        committing_ = false;
+        if (!ok)
+        {
+            corrupt_ = true;
+            cv_.notify_all();
+            throw std::runtime_error("log corrupt");
+        }
+
+        segments_.insert(segments_.end(), opened.begin(), opened.end());
+        for (size_t i = 0; i < recs.size(); i++)
+        {
+            applyRecord(recs[i].type, recs[i].log, recs[i].index, locs[i]);
+        }
+        durable_seq_ = batch_seq;
+        reclaimSegments();
+        cv_.notify_all();
+    }
+}
+
+void WALGroup::writeRecords(const std::vector<uint8_t> &buf,
+                            const std::vector<Record> &recs,
+                            std::vector<Location> &locs,
+                            std::vector<std::shared_ptr<SegmentFile>> &opened)
+{
+    size_t i = 0;
+    while (i < recs.size())
+    {
+        size_t run_start = recs[i].start;
+        if (active_->size > 0 &&
+            active_->size + recs[i].end - run_start > options_.segment_size)
+        {
+            // Earlier records of this commit must be durable before the
+            // segment is left behind.
+            if (!options_.no_sync && ::fdatasync(active_->fd) != 0)
+            {
+                throw std::runtime_error("failed to sync segment file");
+            }
+            active_ = openSegment(active_->id + 1, true);
+            opened.push_back(active_);
+        }
+
+        // Take every following record that still fits in this segment
+        size_t j = i;
+        do
+        {
+            locs[j] = {active_, active_->size + recs[j].data - run_start,
+                       static_cast<uint32_t>(recs[j].end - recs[j].data)};
+            j++;
+        } while (j < recs.size() &&
+                 active_->size + recs[j].end - run_start <= options_.segment_size);
+
+        size_t len = recs[j - 1].end - run_start;
+        size_t done = 0;
+        while (done < len)
+        {
+            ssize_t n = ::write(active_->fd, buf.data() + run_start + done, len - done);
+            if (n <= 0)
+            {
+                throw std::runtime_error("failed to write to segment file");
+            }
+            done += n;
+        }
+        active_->size += len;
+        i = j;
+    }
+
+    if (!options_.no_sync && ::fdatasync(active_->fd) != 0)
+    {
+        throw std::runtime_error("failed to sync segment file");
+    }
+}
+
+std::shared_ptr<WALGroup::SegmentFile> WALGroup::openSegment(uint64_t id, bool create)
+{
+    auto seg = std::make_shared<SegmentFile>();
+    seg->id = id;
+    seg->path = (fs::path(path_) / SegmentName(id)).string();
+
+    int flags = O_RDWR | O_APPEND | (create ? O_CREAT | O_TRUNC : 0);
+    seg->fd = ::open(seg->path.c_str(), flags, options_.file_perms);
+    if (seg->fd < 0)
+    {
+        throw std::runtime_error("failed to open segment file");
+    }
+
+    struct stat st;
+    if (::fstat(seg->fd, &st) != 0)
+    {
+        throw std::runtime_error("failed to stat segment file");
+    }
+    seg->size = st.st_size;
+
+    if (create && !options_.no_sync)
+    {
+        SyncPath(path_);
+    }
+    return seg;
+}
+
+// Segments are only ever removed from the front, once no log references
+// them. Any record that affects a surviving entry was written after it and
+// therefore lives in a surviving segment too.
+void WALGroup::reclaimSegments()
+{
+    while (segments_.size() > 1 && segments_.front() != active_ &&
+           segments_.front()->live == 0)
+    {
+        fs::remove(segments_.front()->path);
+        segments_.pop_front();
+    }
+}
+
+void WALGroup::checkOpen() const
+{
+    if (corrupt_)
+    {
+        throw std::runtime_error("log corrupt");
+    }
+    if (closed_)
+    {
+        throw std::runtime_error("log closed");
+    }
+}
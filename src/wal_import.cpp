@@ -0,0 +1,253 @@
+#include "wal.h"
+#include "wal_codec.h"
+#include "utils.h"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+// Chunks are staged as segments in parallel, then the tail is sealed and
+// one manifest edit adds them all. Writers and truncations are refused
+// meanwhile; readers are not held up.
+uint64_t WAL::Import(const ImportSource &next, size_t threads)
+{
+    if (threads == 0)
+    {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    uint64_t start;
+    LogFormat format;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (corrupt_)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        if (closed_)
+        {
+            throw std::runtime_error("log closed");
+        }
+        if (importing_)
+        {
+            throw std::runtime_error("import in progress");
+        }
+        if (!reserved_.entries.empty())
+        {
+            throw std::runtime_error("reservation pending");
+        }
+        importing_ = true;
+        start = last_index_ + 1;
+        format = options_.log_format;
+    }
+
+    fs::path stage = fs::path(path_) / "import.tmp";
+    std::vector<std::shared_ptr<Segment>> built;
+    try
+    {
+        fs::remove_all(stage);
+        fs::create_directories(stage);
+
+        // Encodes one chunk into a staged segment
+        auto build = [&](const Batch &chunk, Segment &seg)
+        {
+            seg.index = chunk.entries[0].index;
+            seg.format = format;
+            seg.path = (stage / segmentName(seg.index)).string();
+            seg.ebuf = format == LogFormat::BinaryV2 ? segmentHeader(seg.index)
+                                                    : std::vector<uint8_t>();
+            seg.ebuf.reserve(seg.ebuf.size() + chunk.datas.size() + chunk.entries.size() * 16);
+            seg.meta_loaded = true;
+            wal_codec::WithCodec(format, [&](auto codec)
+                                 {
+                using Codec = decltype(codec);
+                const uint8_t *data = chunk.datas.data();
+                for (const auto &entry : chunk.entries)
+                {
+                    size_t pos = seg.ebuf.size();
+                    Codec::Append(seg.ebuf, entry.index, data, entry.size, 0, entry.meta);
+                    seg.epos.emplace_back(pos, seg.ebuf.size());
+                    if (wal_codec::HasMeta(entry.meta))
+                    {
+                        seg.meta.resize(seg.epos.size() - 1);
+                        seg.meta.push_back(entry.meta);
+                    }
+                    data += entry.size;
+                } });
+            if (!WriteFileSync(seg.path, seg.ebuf.data(), seg.ebuf.size(), options_.file_perms))
+            {
+                throw std::runtime_error("failed to write segment file");
+            }
+            // Rebuilt on the first read that misses it
+            writeSegmentIndex(seg);
+        };
+
+        std::vector<Batch> window(threads);
+        uint64_t index = start;
+        bool more = true;
+        while (more)
+        {
+            size_t count = 0;
+            while (count < window.size() && more)
+            {
+                Batch &chunk = window[count];
+                chunk.Clear();
+                size_t bytes = 0;
+                EntryRef entry{};
+                while (bytes < options_.segment_size)
+                {
+                    if (!next(entry))
+                    {
+                        more = false;
+                        break;
+                    }
+                    if (entry.index != index)
+                    {
+                        throw std::runtime_error("out of order");
+                    }
+                    chunk.Write(entry.index, entry.data, entry.size, entry.meta);
+                    bytes += entry.size + 16;
+                    index++;
+                }
+                if (!chunk.entries.empty())
+                {
+                    count++;
+                }
+            }
+            if (count == 0)
+            {
+                break;
+            }
+
+            std::vector<std::shared_ptr<Segment>> segs(count);
+            for (size_t w = 0; w < count; w++)
+            {
+                segs[w] = std::make_shared<Segment>();
+            }
+            RunParallel(count, [&](size_t w)
+                        { build(window[w], *segs[w]); });
+
+            // Only the last segment can become the tail, so only it stays
+            // in memory
+            if (!built.empty())
+            {
+                built.back()->ebuf = std::vector<uint8_t>();
+            }
+            for (size_t w = 0; w + 1 < count; w++)
+            {
+                segs[w]->ebuf = std::vector<uint8_t>();
+            }
+            built.insert(built.end(), segs.begin(), segs.end());
+        }
+    }
+    catch (...)
+    {
+        std::error_code ec;
+        fs::remove_all(stage, ec);
+        std::lock_guard<std::mutex> lock(mutex_);
+        importing_ = false;
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    importing_ = false;
+    std::error_code ec;
+    if (built.empty() || closed_ || corrupt_)
+    {
+        fs::remove_all(stage, ec);
+        if (corrupt_)
+        {
+            throw std::runtime_error("log corrupt");
+        }
+        if (closed_)
+        {
+            throw std::runtime_error("log closed");
+        }
+        return last_index_;
+    }
+
+    try
+    {
+        // An empty tail starts at the first imported index and shares its
+        // file name, so it is dropped by an edit of its own first. A crash
+        // then leaves the log as it was, ending in the previous segment or,
+        // if there is none, in a new empty tail at the same index.
+        bool replace = segments_.back()->epos.empty();
+        if (replace)
+        {
+            appendManifest("del=" + std::to_string(segments_.back()->index));
+            sfile_->close();
+            unmapTail();
+            closeBlob();
+            fs::remove(segments_.back()->path);
+            fs::remove(blobPath(segments_.back()->path), ec);
+        }
+        else
+        {
+            sealTail();
+        }
+
+        // The segments are moved in under names the manifest does not list
+        // yet; the add edit is what makes the import part of the log
+        std::string edit;
+        for (size_t i = 0; i < built.size(); i++)
+        {
+            auto &seg = built[i];
+            std::string dst = (fs::path(path_) / segmentName(seg->index)).string();
+            fs::remove(blobPath(dst), ec);
+            fs::rename(seg->path, dst);
+            if (i + 1 < built.size())
+            {
+                fs::rename(indexPath(seg->path), indexPath(dst), ec);
+            }
+            else
+            {
+                fs::remove(indexPath(dst), ec);
+            }
+            seg->path = dst;
+            edit += (edit.empty() ? "" : " ") + std::string("add=") +
+                    std::to_string(seg->index);
+        }
+        fs::remove_all(stage, ec);
+        SyncPath(path_);
+        appendManifest(edit);
+
+        if (replace)
+        {
+            segments_.pop_back();
+        }
+        for (auto &seg : built)
+        {
+            // Sealed ones keep their offsets only if the index is missing
+            if (seg != built.back() && fs::exists(indexPath(seg->path), ec))
+            {
+                seg->epos = std::vector<std::pair<size_t, size_t>>();
+            }
+            segments_.push_back(seg);
+        }
+        indexSegments();
+
+        auto tail = segments_.back();
+        sfile_ = std::make_unique<std::fstream>(
+            tail->path, std::ios::binary | std::ios::out | std::ios::in);
+        if (!*sfile_)
+        {
+            throw std::runtime_error("failed to open segment file");
+        }
+        sfile_->seekp(0, std::ios::end);
+        openSyncFd();
+        last_index_ = tail->index + tail->epos.size() - 1;
+        if (!options_.no_sync)
+        {
+            durable_index_ = last_index_;
+        }
+    }
+    catch (...)
+    {
+        corrupt_ = true;
+        throw std::runtime_error("log corrupt");
+    }
+    if (!cold_path_.empty())
+    {
+        tier_cv_.notify_one();
+    }
+    return last_index_;
+}
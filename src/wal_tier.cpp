@@ -0,0 +1,237 @@
+#include "wal.h"
+#include "utils.h"
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+namespace
+{
+    // Copies `from` next to `to`, syncs it and renames it into place, so
+    // `to` is either absent or complete.
+    bool copyFileSync(const std::string &from, const std::string &to)
+    {
+        std::string tmp = to + ".tmp";
+        std::error_code ec;
+        if (!fs::copy_file(from, tmp, fs::copy_options::overwrite_existing, ec))
+        {
+            fs::remove(tmp, ec);
+            return false;
+        }
+        try
+        {
+            SyncPath(tmp);
+        }
+        catch (const std::exception &)
+        {
+            fs::remove(tmp, ec);
+            return false;
+        }
+        fs::rename(tmp, to, ec);
+        if (ec)
+        {
+            fs::remove(tmp, ec);
+            return false;
+        }
+        return true;
+    }
+}
+
+bool WAL::isCold(const Segment &seg) const
+{
+    return !cold_path_.empty() && fs::path(seg.path).parent_path() == fs::path(cold_path_);
+}
+
+// Points every segment at the tier that holds it. A segment found in both
+// was being moved when the process stopped, and the hot copy is the one
+// the log still used.
+void WAL::resolveTiers()
+{
+    if (cold_path_.empty() || segments_.empty())
+    {
+        return;
+    }
+    for (auto &seg : segments_)
+    {
+        fs::path hot = fs::path(path_) / segmentName(seg->index);
+        fs::path cold = fs::path(cold_path_) / segmentName(seg->index);
+        std::error_code ec;
+        if (fs::exists(hot, ec))
+        {
+            seg->path = hot.string();
+            fs::remove(cold, ec);
+            fs::remove(indexPath(cold.string()), ec);
+            fs::remove(blobPath(cold.string()), ec);
+        }
+        else if (fs::exists(cold, ec))
+        {
+            seg->path = cold.string();
+        }
+    }
+
+    // The tail is appended in place, so it always lives in the hot tier
+    auto tail = segments_.back();
+    if (isCold(*tail))
+    {
+        std::string hot = (fs::path(path_) / segmentName(tail->index)).string();
+        std::error_code ec;
+        if ((fs::exists(blobPath(tail->path), ec) &&
+             !copyFileSync(blobPath(tail->path), blobPath(hot))) ||
+            !copyFileSync(tail->path, hot))
+        {
+            throw std::runtime_error("failed to restore tail segment");
+        }
+        fs::remove(tail->path, ec);
+        fs::remove(indexPath(tail->path), ec);
+        fs::remove(blobPath(tail->path), ec);
+        tail->path = hot;
+    }
+}
+
+// Returns the oldest hot sealed segment that is due for the cold tier. When
+// none is, `wake` is set to when the next one will be by age.
+std::shared_ptr<WAL::Segment> WAL::pickColdSegment(std::chrono::system_clock::time_point *wake)
+{
+    *wake = std::chrono::system_clock::time_point::max();
+    if (closed_ || corrupt_)
+    {
+        return nullptr;
+    }
+    for (size_t i = 0; i + 1 < segments_.size(); i++)
+    {
+        const auto &seg = segments_[i];
+        if (isCold(*seg))
+        {
+            continue;
+        }
+        if (options_.cold_after_entries == 0 && options_.cold_after_ms == 0)
+        {
+            return seg;
+        }
+
+        uint64_t seg_last = segments_[i + 1]->index - 1;
+        if (options_.cold_after_entries > 0 &&
+            last_index_ - seg_last >= options_.cold_after_entries)
+        {
+            return seg;
+        }
+        if (options_.cold_after_ms > 0)
+        {
+            struct stat st;
+            if (::stat(seg->path.c_str(), &st) == 0)
+            {
+                auto written = std::chrono::system_clock::from_time_t(st.st_mtim.tv_sec) +
+                               std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                                   std::chrono::nanoseconds(st.st_mtim.tv_nsec));
+                auto due = written + std::chrono::milliseconds(options_.cold_after_ms);
+                if (due <= std::chrono::system_clock::now())
+                {
+                    return seg;
+                }
+                *wake = due;
+            }
+        }
+        // Later segments are younger and closer to the tail
+        break;
+    }
+    return nullptr;
+}
+
+// Copies a sealed segment and its side files to the cold tier without the
+// lock, then switches its path under it. A segment cut or dropped meanwhile
+// is left alone. False if the copy failed and should be retried.
+bool WAL::moveToColdTier(const std::shared_ptr<Segment> &seg,
+                         std::unique_lock<std::mutex> &lock)
+{
+    std::string src = seg->path;
+    uint64_t id = seg->id;
+    std::string dst = (fs::path(cold_path_) / segmentName(seg->index)).string();
+
+    lock.unlock();
+    std::error_code ec;
+    // The blob file goes first: a segment in the cold tier has its blobs
+    bool ok = (!fs::exists(blobPath(src), ec) || copyFileSync(blobPath(src), blobPath(dst))) &&
+              copyFileSync(src, dst);
+    if (ok && fs::exists(indexPath(src), ec) &&
+        !copyFileSync(indexPath(src), indexPath(dst)))
+    {
+        // Rebuilt on the first read that misses it
+        fs::remove(indexPath(dst), ec);
+    }
+    if (ok)
+    {
+        try
+        {
+            SyncPath(cold_path_);
+        }
+        catch (const std::exception &)
+        {
+            ok = false;
+        }
+    }
+    lock.lock();
+
+    int i = findSegment(seg->index);
+    bool live = i >= 0 && i + 1 < static_cast<int>(segments_.size()) &&
+                segments_[i] == seg && seg->id == id && seg->path == src &&
+                !closed_;
+    if (!ok || !live)
+    {
+        fs::remove(dst, ec);
+        fs::remove(indexPath(dst), ec);
+        fs::remove(blobPath(dst), ec);
+        return !live || ok;
+    }
+
+    seg->path = dst;
+    fs::remove(src, ec);
+    fs::remove(indexPath(src), ec);
+    fs::remove(blobPath(src), ec);
+    // The cold copy is synced already
+    forgetUnsynced(src);
+    return true;
+}
+
+void WAL::tierLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!tier_stop_)
+    {
+        std::chrono::system_clock::time_point wake;
+        auto seg = pickColdSegment(&wake);
+        if (seg)
+        {
+            if (moveToColdTier(seg, lock))
+            {
+                continue;
+            }
+            // Try again in a while, e.g. once the cold device has room
+            wake = std::chrono::system_clock::now() + std::chrono::seconds(1);
+        }
+        if (tier_stop_)
+        {
+            break;
+        }
+        if (wake == std::chrono::system_clock::time_point::max())
+        {
+            tier_cv_.wait(lock);
+        }
+        else
+        {
+            tier_cv_.wait_until(lock, wake);
+        }
+    }
+}
+
+void WAL::stopTiering()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tier_stop_ = true;
+    }
+    tier_cv_.notify_all();
+    if (tier_thread_.joinable())
+    {
+        tier_thread_.join();
+    }
+}
@@ -1,7 +1,17 @@
 #include "wal.h"
+#include "wal_codec.h"
+#include "wal_group.h"
 #include "utils.h"
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 void TestBasicOperations()
 {
@@ -252,6 +262,2386 @@ void TestSmallSegmentWithCache()
     std::cout << "TestSmallSegmentWithCache passed\n";
 }
 
+void TestTruncateBackInPlace()
+{
+    std::cout << "Running WAL in-place truncate back tests...\n";
+    std::string path = "test_wal_trunc_back";
+    fs::remove_all(path);
+
+    WAL::Options opts;
+    opts.segment_size = 64; // Several entries per segment, many segments
+
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 50; i++)
+        {
+            std::string s = "entry-" + std::to_string(i);
+            wal.Write(i, std::vector<uint8_t>(s.begin(), s.end()));
+        }
+        size_t segs_before = wal.segments_.size();
+        assert(segs_before > 3);
+
+        // Cut inside an older segment: later segments go, no TEMP file is left
+        wal.TruncateBack(12);
+        assert(wal.LastIndex() == 12);
+        assert(wal.segments_.size() < segs_before);
+        assert(!fs::exists(fs::path(path) / "TEMP"));
+
+        // The segment holding the cut was shrunk to the entry boundary
+        for (const auto &seg : wal.segments_)
+        {
+            if (seg->index <= 12 && 12 < seg->index + seg->epos.size())
+            {
+                assert(fs::file_size(seg->path) == seg->epos.back().second);
+            }
+        }
+
+        auto data = wal.Read(12);
+        assert(std::string(data.begin(), data.end()) == "entry-12");
+
+        // Appends continue right after the cut
+        for (uint64_t i = 13; i <= 20; i++)
+        {
+            std::string s = "new-" + std::to_string(i);
+            wal.Write(i, std::vector<uint8_t>(s.begin(), s.end()));
+        }
+        wal.TruncateBack(18);
+        assert(wal.LastIndex() == 18);
+    }
+
+    {
+        WAL wal(path, opts);
+        assert(wal.FirstIndex() == 1);
+        assert(wal.LastIndex() == 18);
+        auto data = wal.Read(11);
+        assert(std::string(data.begin(), data.end()) == "entry-11");
+        data = wal.Read(18);
+        assert(std::string(data.begin(), data.end()) == "new-18");
+
+        // A cut inside the tail shrinks it without starting a segment
+        wal.Write(19, {'a'});
+        wal.Write(20, {'b'});
+        auto tail = wal.segments_.back();
+        size_t segs = wal.segments_.size();
+        assert(tail->index < 20);
+        wal.TruncateBack(19);
+        assert(wal.segments_.size() == segs);
+        assert(wal.segments_.back()->index == tail->index);
+        assert(fs::file_size(tail->path) == wal.segments_.back()->epos.back().second);
+        {
+            // Two appended edits, no manifest rewrite
+            std::ifstream in(fs::path(path) / "MANIFEST", std::ios::binary);
+            std::string manifest((std::istreambuf_iterator<char>(in)),
+                                 std::istreambuf_iterator<char>());
+            assert(manifest.size() > 15 &&
+                   manifest.compare(manifest.size() - 15, 15, "back=19\nback=0\n") == 0);
+        }
+        wal.Write(20, {'c'});
+    }
+
+    {
+        // A back edit whose cut never reached the file bounds the tail
+        {
+            std::ofstream manifest(fs::path(path) / "MANIFEST", std::ios::binary | std::ios::app);
+            manifest << "back=19\n";
+        }
+        WAL wal(path, opts);
+        assert(wal.LastIndex() == 19);
+        assert(wal.Read(19) == std::vector<uint8_t>({'a'}));
+
+        // and stops bounding it once applied
+        wal.Write(20, {'d'});
+        wal.Write(21, {'e'});
+    }
+
+    {
+        WAL wal(path, opts);
+        assert(wal.LastIndex() == 21);
+        assert(wal.Read(20) == std::vector<uint8_t>({'d'}));
+    }
+
+    {
+        // A cut whose manifest edit fails leaves the log corrupt, not half
+        // closed
+        WAL::Options failing = opts;
+        failing.manifest_compact_edits = 1; // every edit compacts first
+        WAL wal(path, failing);
+        fs::create_directory(fs::path(path) / "MANIFEST.tmp");
+        bool threw = false;
+        try
+        {
+            wal.TruncateBack(15);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+        std::string error;
+        try
+        {
+            wal.Write(22, {'f'});
+        }
+        catch (const std::runtime_error &e)
+        {
+            error = e.what();
+        }
+        assert(error == "log corrupt");
+        fs::remove(fs::path(path) / "MANIFEST.tmp");
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestTruncateBackInPlace passed\n";
+}
+
+void TestManifest()
+{
+    std::cout << "Running WAL manifest tests...\n";
+    std::string path = "test_wal_manifest";
+    fs::remove_all(path);
+
+    WAL::Options opts;
+    opts.segment_size = 64;
+    opts.manifest_compact_edits = 4; // Compact often
+
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 60; i++)
+        {
+            std::string s = "entry-" + std::to_string(i);
+            wal.Write(i, std::vector<uint8_t>(s.begin(), s.end()));
+        }
+        wal.TruncateFront(15);
+        wal.TruncateBack(40);
+    }
+
+    // Truncations leave no rename protocol files behind
+    for (const auto &entry : fs::directory_iterator(path))
+    {
+        std::string name = entry.path().filename().string();
+        assert(name.find(".START") == std::string::npos);
+        assert(name.find(".END") == std::string::npos);
+        assert(name != "TEMP");
+    }
+    assert(fs::exists(fs::path(path) / "MANIFEST"));
+
+    {
+        WAL wal(path, opts);
+        assert(wal.FirstIndex() == 15);
+        assert(wal.LastIndex() == 40);
+
+        // Front truncation is logical; earlier entries stay unreachable
+        bool threw = false;
+        try
+        {
+            wal.Read(14);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+
+        auto data = wal.Read(15);
+        assert(std::string(data.begin(), data.end()) == "entry-15");
+        data = wal.Read(40);
+        assert(std::string(data.begin(), data.end()) == "entry-40");
+
+        wal.Write(41, {'x'});
+    }
+
+    // A stray segment file the manifest does not list is not picked up
+    {
+        std::ofstream stray(fs::path(path) / "00000000000000099999", std::ios::binary);
+        stray << "junk";
+    }
+    {
+        WAL wal(path, opts);
+        assert(wal.FirstIndex() == 15);
+        assert(wal.LastIndex() == 41);
+        assert(wal.Read(41) == std::vector<uint8_t>({'x'}));
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestManifest passed\n";
+}
+
+void TestVerifyOnOpen()
+{
+    std::cout << "Running WAL verify on open tests...\n";
+    std::string path = "test_wal_verify";
+    fs::remove_all(path);
+
+    WAL::Options opts;
+    opts.segment_size = 64;
+
+    std::string middle;
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 100; i++)
+        {
+            std::string s = "entry-" + std::to_string(i);
+            wal.Write(i, std::vector<uint8_t>(s.begin(), s.end()));
+        }
+        middle = wal.segments_[wal.segments_.size() / 2]->path;
+    }
+
+    opts.verify_on_open = true;
+    opts.verify_threads = 4;
+    fs::remove(middle + ".idx");
+    {
+        WAL wal(path, opts);
+        assert(wal.LastIndex() == 100);
+        auto data = wal.Read(50);
+        assert(std::string(data.begin(), data.end()) == "entry-50");
+        // Verified segments leave their offsets to the index files
+        for (size_t i = 0; i + 1 < wal.segments_.size(); i++)
+        {
+            assert(wal.segments_[i]->epos.empty());
+        }
+        assert(fs::exists(middle + ".idx"));
+    }
+
+    // Chop the last record of a sealed segment in half
+    fs::resize_file(middle, fs::file_size(middle) - 3);
+
+    bool threw = false;
+    try
+    {
+        WAL wal(path, opts);
+    }
+    catch (const std::runtime_error &e)
+    {
+        threw = std::string(e.what()).find("first bad index") != std::string::npos;
+    }
+    assert(threw);
+
+    // Without verification only the tail is read, so the log still opens
+    opts.verify_on_open = false;
+    {
+        WAL wal(path, opts);
+        assert(wal.LastIndex() == 100);
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestVerifyOnOpen passed\n";
+}
+
+void TestWALGroup()
+{
+    std::cout << "Running WALGroup tests...\n";
+    std::string path = "test_wal_group";
+    fs::remove_all(path);
+
+    WALGroup::Options opts;
+    opts.segment_size = 512; // Force shared segments to rotate
+
+    {
+        WALGroup group(path, opts);
+
+        // Every log is appended from its own thread
+        std::vector<std::thread> writers;
+        for (uint64_t log = 1; log <= 8; log++)
+        {
+            writers.emplace_back([&group, log]()
+                                 {
+                for (uint64_t i = 1; i <= 100; i++)
+                {
+                    std::string s = std::to_string(log) + ":" + std::to_string(i);
+                    group.Write(log, i, std::vector<uint8_t>(s.begin(), s.end()));
+                } });
+        }
+        for (auto &t : writers)
+        {
+            t.join();
+        }
+
+        assert(group.Logs().size() == 8);
+        for (uint64_t log = 1; log <= 8; log++)
+        {
+            assert(group.FirstIndex(log) == 1);
+            assert(group.LastIndex(log) == 100);
+            auto data = group.Read(log, 42);
+            assert(std::string(data.begin(), data.end()) == std::to_string(log) + ":42");
+        }
+
+        // Index spaces are independent
+        bool threw = false;
+        try
+        {
+            group.Write(3, 7, {'x'});
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+
+        WAL::Batch batch;
+        batch.Write(101, {'b', '1'});
+        batch.Write(102, {'b', '2'});
+        group.WriteBatch(1, &batch);
+        assert(group.LastIndex(1) == 102);
+
+        group.TruncateBack(2, 50);
+        group.Write(2, 51, {'n', 'e', 'w'});
+        for (uint64_t log = 1; log <= 8; log++)
+        {
+            group.TruncateFront(log, log == 2 ? 45 : 90);
+        }
+    }
+
+    // Segments whose entries were all truncated away are removed
+    size_t files = std::distance(fs::directory_iterator(path), fs::directory_iterator{});
+    assert(files < 10);
+
+    {
+        WALGroup group(path, opts);
+        assert(group.Logs().size() == 8);
+        assert(group.FirstIndex(1) == 90);
+        assert(group.LastIndex(1) == 102);
+        assert(group.Read(1, 102) == std::vector<uint8_t>({'b', '2'}));
+        assert(group.FirstIndex(2) == 45);
+        assert(group.LastIndex(2) == 51);
+        assert(group.Read(2, 51) == std::vector<uint8_t>({'n', 'e', 'w'}));
+        auto data = group.Read(8, 100);
+        assert(std::string(data.begin(), data.end()) == "8:100");
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestWALGroup passed\n";
+}
+
+// Reaches into WAL for hooks the public API has no use for
+struct WALTestAccess
+{
+    static void WaitReadahead(WAL &wal)
+    {
+        wal.waitReadahead();
+    }
+};
+
+void TestReadahead()
+{
+    std::cout << "Running WAL readahead tests...\n";
+    std::string path = "test_wal_readahead";
+    fs::remove_all(path);
+
+    WAL::Options opts;
+    opts.segment_size = 128;
+    opts.segment_cache_size = 2;
+
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 200; i++)
+        {
+            std::string s = "entry-" + std::to_string(i);
+            wal.Write(i, std::vector<uint8_t>(s.begin(), s.end()));
+        }
+    }
+
+    {
+        WAL wal(path, opts);
+        assert(wal.segments_.size() > 4);
+        auto second = wal.segments_[1];
+
+        // Read sequentially to the end of the first segment
+        for (uint64_t i = 1; i < second->index; i++)
+        {
+            auto data = wal.Read(i);
+            assert(std::string(data.begin(), data.end()) == "entry-" + std::to_string(i));
+        }
+
+        // The next segment is loaded in the background, so it is served
+        // even once its file is gone
+        WALTestAccess::WaitReadahead(wal);
+        fs::rename(second->path, second->path + ".moved");
+        auto data = wal.Read(second->index);
+        assert(std::string(data.begin(), data.end()) == "entry-" + std::to_string(second->index));
+        fs::rename(second->path + ".moved", second->path);
+
+        // Catching up across every boundary still returns the right entries
+        for (uint64_t i = second->index; i <= 200; i++)
+        {
+            auto data = wal.Read(i);
+            assert(std::string(data.begin(), data.end()) == "entry-" + std::to_string(i));
+        }
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestReadahead passed\n";
+}
+
+void TestWriteOverloads()
+{
+    std::cout << "Running WAL write overload tests...\n";
+    std::string path = "test_wal_overloads";
+    fs::remove_all(path);
+
+    for (auto format : {WAL::LogFormat::Binary, WAL::LogFormat::JSON})
+    {
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 64;
+        {
+            WAL wal(path, opts);
+
+            // Pointer and length, e.g. from a string_view
+            std::string s = "from a string";
+            wal.Write(1, reinterpret_cast<const uint8_t *>(s.data()), s.size());
+
+            // Moved vector
+            std::vector<uint8_t> moved = {'m', 'o', 'v', 'e', 'd'};
+            wal.Write(2, std::move(moved));
+
+            WAL::Batch batch;
+            batch.Write(3, std::vector<uint8_t>{'r', 'v'});
+            batch.Write(4, reinterpret_cast<const uint8_t *>(s.data()), 4);
+            batch.Write(5, std::vector<uint8_t>{0xff, 0x00});
+            wal.WriteBatch(&batch);
+            for (uint64_t i = 6; i <= 40; i++)
+            {
+                wal.Write(i, {static_cast<uint8_t>(i)});
+            }
+        }
+        {
+            WAL wal(path, opts);
+            auto data = wal.Read(1);
+            assert(std::string(data.begin(), data.end()) == "from a string");
+            assert(wal.Read(2) == std::vector<uint8_t>({'m', 'o', 'v', 'e', 'd'}));
+            assert(wal.Read(3) == std::vector<uint8_t>({'r', 'v'}));
+            assert(wal.Read(4) == std::vector<uint8_t>({'f', 'r', 'o', 'm'}));
+            assert(wal.Read(5) == std::vector<uint8_t>({0xff, 0x00}));
+            assert(wal.Read(40) == std::vector<uint8_t>({40}));
+        }
+        fs::remove_all(path);
+    }
+
+    std::cout << "TestWriteOverloads passed\n";
+}
+
+void TestReserveCommit()
+{
+    std::cout << "Running WAL reserve/commit tests...\n";
+    std::string path = "test_wal_reserve";
+
+    for (auto format : {WAL::LogFormat::Binary, WAL::LogFormat::JSON})
+    {
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 64;
+        {
+            WAL wal(path, opts);
+            wal.Write(1, {'a'});
+
+            // Serialize straight into the reserved regions
+            for (uint64_t i = 2; i <= 30; i++)
+            {
+                std::string s = "reserved-" + std::to_string(i);
+                uint8_t *buf = wal.Reserve(i, s.size());
+                std::memcpy(buf, s.data(), s.size());
+                if (i % 5 == 0)
+                {
+                    wal.Commit();
+                }
+            }
+            assert(wal.LastIndex() == 30);
+
+            // Uncommitted entries are invisible and block other writes
+            uint8_t *buf = wal.Reserve(31, 3);
+            std::memcpy(buf, "bad", 3);
+            assert(wal.LastIndex() == 30);
+            bool threw = false;
+            try
+            {
+                wal.Write(31, {'x'});
+            }
+            catch (const std::runtime_error &)
+            {
+                threw = true;
+            }
+            assert(threw);
+
+            wal.Abort();
+            wal.Write(31, {'o', 'k'});
+        }
+        {
+            WAL wal(path, opts);
+            assert(wal.LastIndex() == 31);
+            auto data = wal.Read(17);
+            assert(std::string(data.begin(), data.end()) == "reserved-17");
+            assert(wal.Read(31) == std::vector<uint8_t>({'o', 'k'}));
+        }
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestReserveCommit passed\n";
+}
+
+void TestAppendNext()
+{
+    std::cout << "Running WAL AppendNext tests...\n";
+    std::string path = "test_wal_append_next";
+    fs::remove_all(path);
+
+    WAL::Options opts;
+    opts.segment_size = 1024;
+
+    const uint64_t producers = 8;
+    const uint64_t per_producer = 200;
+    std::vector<std::vector<uint64_t>> assigned(producers);
+    {
+        WAL wal(path, opts);
+        wal.Write(1, {'s', 't', 'a', 'r', 't'});
+
+        std::vector<std::thread> threads;
+        for (uint64_t p = 0; p < producers; p++)
+        {
+            threads.emplace_back([&wal, &assigned, p, per_producer]()
+                                 {
+                for (uint64_t i = 0; i < per_producer; i++)
+                {
+                    std::string s = std::to_string(p) + "/" + std::to_string(i);
+                    assigned[p].push_back(wal.AppendNext(std::vector<uint8_t>(s.begin(), s.end())));
+                } });
+        }
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        assert(wal.LastIndex() == 1 + producers * per_producer);
+    }
+
+    {
+        WAL wal(path, opts);
+        std::vector<bool> seen(2 + producers * per_producer, false);
+        for (uint64_t p = 0; p < producers; p++)
+        {
+            for (uint64_t i = 0; i < per_producer; i++)
+            {
+                uint64_t index = assigned[p][i];
+                assert(index >= 2 && !seen[index]);
+                seen[index] = true;
+                // A producer's entries keep their submission order
+                assert(i == 0 || index > assigned[p][i - 1]);
+                auto data = wal.Read(index);
+                assert(std::string(data.begin(), data.end()) ==
+                       std::to_string(p) + "/" + std::to_string(i));
+            }
+        }
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestAppendNext passed\n";
+}
+
+void TestBase64AndUTF8()
+{
+    std::cout << "Running base64 and UTF-8 kernel tests...\n";
+
+    // Reference encoder, one bit at a time
+    auto reference = [](const std::vector<uint8_t> &in, bool url_safe)
+    {
+        const char *alphabet = url_safe
+                                   ? "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_"
+                                   : "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        size_t bits = in.size() * 8;
+        for (size_t b = 0; b < bits; b += 6)
+        {
+            int v = 0;
+            for (size_t k = 0; k < 6; k++)
+            {
+                size_t bit = b + k;
+                int set = bit < bits ? (in[bit / 8] >> (7 - bit % 8)) & 1 : 0;
+                v = (v << 1) | set;
+            }
+            out += alphabet[v];
+        }
+        while (out.size() % 4)
+        {
+            out += '=';
+        }
+        return out;
+    };
+
+    srand(7);
+    for (size_t len = 0; len < 300; len++)
+    {
+        std::vector<uint8_t> data(len);
+        for (auto &b : data)
+        {
+            b = static_cast<uint8_t>(rand());
+        }
+        for (bool url_safe : {false, true})
+        {
+            std::string encoded = base64_encode(data.data(), data.size(), url_safe);
+            assert(encoded == reference(data, url_safe));
+            assert(base64_decode(encoded) == data);
+        }
+    }
+    assert(base64_decode("TWE=") == std::vector<uint8_t>({'M', 'a'}));
+    // Decoding stops at the first character outside the alphabets
+    assert(base64_decode("TWFuTWFuTWFuTWFuTWFu=TWFu") == base64_decode("TWFuTWFuTWFuTWFuTWFu"));
+
+    auto plain = [](const std::string &s)
+    {
+        return IsPlainUTF8(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+    };
+    std::string ascii(100, 'a');
+    assert(plain(""));
+    assert(plain(ascii));
+    assert(plain(std::string(31, 'a') + "你好，世界" + ascii)); // Crosses block boundaries
+    assert(!plain(ascii + "\"" + ascii));
+    assert(!plain(ascii + "\\" + ascii));
+    assert(!plain(ascii + "\n"));
+    assert(!plain(ascii + "\xe4\xbd"));               // Truncated at the end
+    assert(!plain(std::string(40, 'a') + "\xe4\x41\xa0" + ascii)); // Bad continuation
+    assert(!plain(ascii + "\xff" + ascii));
+
+    std::cout << "TestBase64AndUTF8 passed\n";
+}
+
+void TestSegmentScan()
+{
+    std::cout << "Running WAL segment scan tests...\n";
+    std::string path = "test_wal_scan";
+    fs::remove_all(path);
+
+    // Payload sizes covering one, two and three byte length prefixes
+    auto payload = [](uint64_t i)
+    {
+        static const size_t sizes[] = {0, 1, 127, 128, 300, 16383, 16384, 40000};
+        return std::vector<uint8_t>(sizes[i % 8], static_cast<uint8_t>('a' + i % 26));
+    };
+
+    for (auto format : {WAL::LogFormat::Binary, WAL::LogFormat::JSON})
+    {
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 100000;
+        opts.segment_cache_size = 1;
+        {
+            WAL wal(path, opts);
+            for (uint64_t i = 1; i <= 100; i++)
+            {
+                wal.Write(i, payload(i));
+            }
+        }
+        {
+            WAL wal(path, opts);
+            assert(wal.LastIndex() == 100);
+            for (uint64_t i = 1; i <= 100; i++)
+            {
+                assert(wal.Read(i) == payload(i));
+            }
+        }
+        fs::remove_all(path);
+    }
+
+    std::string text = std::string(40, '\n') + "abc\n" + std::string(70, 'x') + "\n";
+    assert(CountByte(reinterpret_cast<const uint8_t *>(text.data()), text.size(), '\n') == 42);
+    assert(CountByte(reinterpret_cast<const uint8_t *>(text.data()), 3, '\n') == 3);
+
+    std::cout << "TestSegmentScan passed\n";
+}
+
+void TestConvert()
+{
+    std::cout << "Running WAL convert tests...\n";
+    std::string path = "test_wal_convert";
+    fs::remove_all(path);
+
+    auto payload = [](uint64_t i)
+    {
+        std::string s = "entry-" + std::to_string(i);
+        std::vector<uint8_t> data(s.begin(), s.end());
+        if (i % 3 == 0)
+        {
+            data.push_back(0xff); // Forces base64 in JSON
+        }
+        return data;
+    };
+    auto countSegments = [&]()
+    {
+        size_t n = 0;
+        for (const auto &entry : fs::directory_iterator(path))
+        {
+            n += entry.path().filename().string().size() == 20;
+        }
+        return n;
+    };
+
+    WAL::Options json;
+    json.log_format = WAL::LogFormat::JSON;
+    json.segment_size = 64;
+    {
+        WAL wal(path, json);
+        for (uint64_t i = 1; i <= 200; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        wal.TruncateFront(15);
+    }
+    size_t tiny = countSegments();
+
+    WAL::Options binary;
+    binary.segment_size = 1024;
+    WAL::Convert(path, json, binary, 3);
+    assert(countSegments() < tiny);
+    assert(!fs::exists(path + ".convert"));
+    {
+        WAL wal(path, binary);
+        assert(wal.FirstIndex() == 15);
+        assert(wal.LastIndex() == 200);
+        for (uint64_t i = 15; i <= 200; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+        wal.Write(201, payload(201));
+    }
+
+    // And back, into one segment
+    WAL::Options big = json;
+    big.segment_size = 1 << 20;
+    WAL::Convert(path, binary, big);
+    assert(countSegments() == 1);
+    {
+        WAL wal(path, big);
+        assert(wal.FirstIndex() == 15);
+        assert(wal.LastIndex() == 201);
+        for (uint64_t i = 15; i <= 201; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+    }
+
+    fs::remove_all(path);
+    std::cout << "TestConvert passed\n";
+}
+
+void TestBinaryV2()
+{
+    std::cout << "Running WAL binary v2 format tests...\n";
+    std::string path = "test_wal_v2";
+    fs::remove_all(path);
+
+    const char *check = "123456789";
+    assert(Crc32c(reinterpret_cast<const uint8_t *>(check), 9) == 0xe3069283);
+    assert(Crc32c(reinterpret_cast<const uint8_t *>(check) + 4, 5,
+                  Crc32c(reinterpret_cast<const uint8_t *>(check), 4)) == 0xe3069283);
+
+    auto payload = [](uint64_t i)
+    {
+        return std::vector<uint8_t>(i % 40, static_cast<uint8_t>(i));
+    };
+
+    WAL::Options v1;
+    v1.segment_size = 256;
+    WAL::Options v2 = v1;
+    v2.log_format = WAL::LogFormat::BinaryV2;
+
+    // v1 segments stay as they are; segments created afterwards are v2
+    {
+        WAL wal(path, v1);
+        for (uint64_t i = 1; i <= 30; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+    }
+    {
+        WAL wal(path, v2);
+        for (uint64_t i = 31; i <= 60; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        uint8_t *p = wal.Reserve(61, 3);
+        std::memcpy(p, "abc", 3);
+        wal.Commit();
+    }
+    std::string last_v2;
+    for (auto opts : {v1, v2})
+    {
+        WAL wal(path, opts);
+        assert(wal.LastIndex() == 61);
+        for (uint64_t i = 1; i <= 60; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+        assert(wal.Read(61) == std::vector<uint8_t>({'a', 'b', 'c'}));
+        last_v2 = wal.segments_[wal.segments_.size() - 2]->path;
+    }
+
+    std::ifstream head(last_v2, std::ios::binary);
+    char magic[8];
+    head.read(magic, 8);
+    assert(std::memcmp(magic, "\x89WALSEG\n", 8) == 0);
+
+    // Back truncation inside a v2 segment starts a fresh v2 tail
+    {
+        WAL wal(path, v2);
+        wal.TruncateBack(45);
+        wal.Write(46, payload(46));
+    }
+    std::string sealed;
+    {
+        WAL wal(path, v1);
+        assert(wal.LastIndex() == 46);
+        assert(wal.Read(45) == payload(45));
+        assert(wal.Read(46) == payload(46));
+        assert(wal.segments_.size() >= 2);
+        sealed = wal.segments_[wal.segments_.size() - 2]->path;
+    }
+
+    // A flipped payload bit in a sealed segment fails the record checksum
+    {
+        std::fstream f(sealed, std::ios::binary | std::ios::in | std::ios::out);
+        f.seekg(0, std::ios::end);
+        std::streamoff end = f.tellg();
+        f.seekg(end - 1);
+        char c;
+        f.read(&c, 1);
+        c ^= 1;
+        f.seekp(end - 1);
+        f.write(&c, 1);
+    }
+    bool caught = false;
+    try
+    {
+        WAL::Options verify = v2;
+        verify.verify_on_open = true;
+        WAL wal(path, verify);
+    }
+    catch (const std::runtime_error &e)
+    {
+        caught = std::string(e.what()).find("log corrupt") == 0;
+    }
+    assert(caught);
+
+    fs::remove_all(path);
+    std::cout << "TestBinaryV2 passed\n";
+}
+
+void TestPointRead()
+{
+    std::cout << "Running WAL cold point read tests...\n";
+    std::string path = "test_wal_point_read";
+    fs::remove_all(path);
+
+    auto payload = [](uint64_t i)
+    {
+        std::string s = "point-" + std::to_string(i * 7919);
+        return std::vector<uint8_t>(s.begin(), s.end());
+    };
+
+    for (auto format : {WAL::LogFormat::Binary, WAL::LogFormat::JSON, WAL::LogFormat::BinaryV2})
+    {
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 128;
+        opts.segment_cache_size = 1;
+        {
+            WAL wal(path, opts);
+            for (uint64_t i = 1; i <= 200; i++)
+            {
+                wal.Write(i, payload(i));
+            }
+        }
+        {
+            WAL wal(path, opts);
+            // Strided reads never load a sealed segment
+            for (uint64_t i = 190; i >= 3; i -= 3)
+            {
+                assert(wal.Read(i) == payload(i));
+            }
+            for (size_t k = 0; k + 1 < wal.segments_.size(); k++)
+            {
+                assert(wal.segments_[k]->ebuf.empty());
+                assert(fs::exists(wal.segments_[k]->path + ".idx"));
+            }
+
+            // A lost index is rebuilt by the read that misses it
+            std::string first = wal.segments_[0]->path;
+            fs::remove(first + ".idx");
+            wal.ClearCache();
+            assert(wal.Read(2) == payload(2));
+            assert(wal.segments_[0]->ebuf.empty());
+            assert(fs::exists(first + ".idx"));
+
+            for (uint64_t i = 50; i <= 60; i++)
+            {
+                assert(wal.Read(i) == payload(i));
+            }
+
+            wal.TruncateBack(100);
+            wal.Write(101, payload(1));
+        }
+        {
+            WAL wal(path, opts);
+            assert(wal.Read(101) == payload(1));
+            for (uint64_t i = 99; i >= 80; i -= 2)
+            {
+                assert(wal.Read(i) == payload(i));
+            }
+        }
+        fs::remove_all(path);
+    }
+
+    std::cout << "TestPointRead passed\n";
+}
+
+void TestBlockCache()
+{
+    std::cout << "Running block cache tests...\n";
+
+    auto block = [](size_t size, uint8_t fill)
+    {
+        return std::make_shared<const std::vector<uint8_t>>(size, fill);
+    };
+
+    // One shard so eviction order is observable
+    BlockCache cache(4096, 1024, 1);
+    for (uint64_t b = 0; b < 4; b++)
+    {
+        cache.Insert(1, b, block(1024, static_cast<uint8_t>(b)));
+    }
+    assert(cache.Usage() == 4096);
+    assert((*cache.Lookup(1, 2))[0] == 2);
+
+    // Block 2 was referenced, so the clock passes it over
+    cache.Insert(2, 0, block(1024, 9));
+    assert(cache.Usage() == 4096);
+    assert(cache.Lookup(1, 2));
+    assert(cache.Lookup(2, 0));
+    size_t left = 0;
+    for (uint64_t b = 0; b < 4; b++)
+    {
+        left += cache.Lookup(1, b) != nullptr;
+    }
+    assert(left == 3);
+
+    // Blocks larger than a shard are not cached; replacing keeps the count
+    cache.Insert(3, 0, block(8192, 0));
+    assert(!cache.Lookup(3, 0));
+    cache.Insert(2, 0, block(512, 7));
+    assert((*cache.Lookup(2, 0))[0] == 7);
+    assert(cache.Usage() <= cache.Capacity());
+
+    cache.Clear();
+    assert(cache.Usage() == 0 && !cache.Lookup(2, 0));
+
+    // Many readers of a log whose history only fits partly in the cache
+    std::string path = "test_wal_block_cache";
+    fs::remove_all(path);
+    WAL::Options opts;
+    opts.segment_size = 4096;
+    opts.block_cache_size = 1 << 20;
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 3000; i++)
+        {
+            wal.Write(i, std::vector<uint8_t>(100 + i % 300, static_cast<uint8_t>(i)));
+        }
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++)
+        {
+            readers.emplace_back([&wal, t]()
+                                 {
+                uint64_t x = 88172645463325252ULL + t;
+                for (int n = 0; n < 2000; n++)
+                {
+                    x ^= x << 13;
+                    x ^= x >> 7;
+                    x ^= x << 17;
+                    uint64_t i = 1 + x % 3000;
+                    auto data = wal.Read(i);
+                    assert(data.size() == 100 + i % 300 && data[0] == static_cast<uint8_t>(i));
+                } });
+        }
+        for (auto &r : readers)
+        {
+            r.join();
+        }
+    }
+    fs::remove_all(path);
+
+    std::cout << "TestBlockCache passed\n";
+}
+
+void TestCheckpoint()
+{
+    std::cout << "Running WAL checkpoint tests...\n";
+    std::string path = "test_wal_checkpoint";
+    std::string snap = "test_wal_checkpoint_snap";
+    fs::remove_all(path);
+    fs::remove_all(snap);
+
+    auto payload = [](uint64_t i)
+    {
+        std::string s = "cp-" + std::to_string(i);
+        return std::vector<uint8_t>(s.begin(), s.end());
+    };
+
+    WAL::Options opts;
+    opts.segment_size = 128;
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 100; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        wal.TruncateFront(5);
+
+        // A writer keeps going while the checkpoint is taken
+        std::thread writer([&wal, &payload]()
+                           {
+            for (uint64_t i = 101; i <= 300; i++)
+            {
+                wal.Write(i, payload(i));
+            } });
+        wal.Checkpoint(snap);
+        writer.join();
+
+        bool caught = false;
+        try
+        {
+            wal.Checkpoint(snap);
+        }
+        catch (const std::runtime_error &)
+        {
+            caught = true;
+        }
+        assert(caught);
+
+        // Rewriting history does not reach the linked segments
+        wal.TruncateBack(50);
+        wal.Write(51, {'x'});
+        wal.TruncateFront(40);
+        assert(wal.Read(51) == std::vector<uint8_t>({'x'}));
+    }
+    {
+        WAL wal(snap, opts);
+        assert(wal.FirstIndex() == 5);
+        assert(wal.LastIndex() >= 100 && wal.LastIndex() <= 300);
+        for (uint64_t i = 5; i <= wal.LastIndex(); i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+    }
+
+    fs::remove_all(path);
+    fs::remove_all(snap);
+    std::cout << "TestCheckpoint passed\n";
+}
+
+void TestSyncPolicy()
+{
+    std::cout << "Running WAL sync policy tests...\n";
+    std::string path = "test_wal_sync";
+    fs::remove_all(path);
+
+    auto payload = [](uint64_t i)
+    {
+        std::string s = "sync-" + std::to_string(i);
+        return std::vector<uint8_t>(s.begin(), s.end());
+    };
+
+    {
+        // Default: every write is durable when it returns
+        WAL wal(path, WAL::Options());
+        for (uint64_t i = 1; i <= 10; i++)
+        {
+            wal.Write(i, payload(i));
+            assert(wal.DurableIndex() == i);
+        }
+        wal.Close();
+    }
+    {
+        // Entry threshold: the sync thread catches up after the 5th entry
+        WAL::Options opts;
+        opts.sync_entries = 5;
+        WAL wal(path, opts);
+        assert(wal.DurableIndex() == 10);
+        for (uint64_t i = 11; i <= 14; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        assert(wal.DurableIndex() == 10);
+        wal.Write(15, payload(15));
+        for (int i = 0; i < 100 && wal.DurableIndex() < 15; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        assert(wal.DurableIndex() == 15);
+
+        // Sync makes everything durable at once
+        wal.Write(16, payload(16));
+        wal.Sync();
+        assert(wal.DurableIndex() == 16);
+        wal.Close();
+    }
+    {
+        // Interval: a lone write becomes durable within the interval
+        WAL::Options opts;
+        opts.sync_interval_ms = 20;
+        opts.segment_size = 64;
+        WAL wal(path, opts);
+        for (uint64_t i = 17; i <= 40; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        // Sealed segments are synced as they cycle
+        assert(wal.DurableIndex() > 16);
+        for (int i = 0; i < 100 && wal.DurableIndex() < 40; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        assert(wal.DurableIndex() == 40);
+
+        wal.TruncateBack(30);
+        assert(wal.DurableIndex() == 30);
+        wal.Close();
+    }
+    {
+        WAL wal(path, WAL::Options());
+        assert(wal.LastIndex() == 30);
+        assert(wal.DurableIndex() == 30);
+        wal.Close();
+    }
+    {
+        // Segments sealed under no_sync and then truncated away don't
+        // break the next Sync
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.no_sync = true;
+        opts.segment_size = 64;
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 40; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        assert(wal.segments_.size() > 2);
+        wal.TruncateFront(wal.segments_.back()->index);
+        wal.Sync();
+        wal.Sync();
+        wal.Write(41, payload(41));
+        assert(wal.Read(41) == payload(41));
+        wal.Close();
+    }
+
+    fs::remove_all(path);
+    std::cout << "WAL sync policy tests passed\n";
+}
+
+void TestWriteAsync()
+{
+    std::cout << "Running WAL async write tests...\n";
+    std::string path = "test_wal_async";
+    fs::remove_all(path);
+
+    auto payload = [](uint64_t i)
+    {
+        std::string s = "async-" + std::to_string(i);
+        return std::vector<uint8_t>(s.begin(), s.end());
+    };
+
+    {
+        WAL::Options opts;
+        opts.segment_size = 256;
+        WAL wal(path, opts);
+
+        // Futures resolve with the batch's last index once it is durable
+        std::vector<std::future<uint64_t>> futures;
+        uint64_t index = 1;
+        for (int b = 0; b < 50; b++)
+        {
+            WAL::Batch batch;
+            for (int e = 0; e < 3; e++, index++)
+            {
+                batch.Write(index, payload(index));
+            }
+            futures.push_back(wal.WriteAsync(&batch));
+        }
+        for (size_t b = 0; b < futures.size(); b++)
+        {
+            uint64_t last = futures[b].get();
+            assert(last == (b + 1) * 3);
+            assert(wal.DurableIndex() >= last);
+        }
+
+        // Callbacks run in index order, interleaved with plain writes
+        std::mutex mu;
+        std::vector<uint64_t> done;
+        for (int b = 0; b < 50; b++, index++)
+        {
+            WAL::Batch batch;
+            batch.Write(index, payload(index));
+            wal.WriteAsync(&batch, [&](uint64_t i, std::exception_ptr error)
+                           {
+                assert(!error);
+                std::lock_guard<std::mutex> lock(mu);
+                done.push_back(i); });
+            if (b % 10 == 0)
+            {
+                index++;
+                wal.Write(index, payload(index));
+            }
+        }
+        wal.Sync();
+        for (int i = 0; i < 100; i++)
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (done.size() == 50)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            assert(done.size() == 50);
+            assert(std::is_sorted(done.begin(), done.end()));
+        }
+
+        // Out of order batches fail at once
+        WAL::Batch bad;
+        bad.Write(index + 5, payload(index + 5));
+        bool caught = false;
+        try
+        {
+            wal.WriteAsync(&bad);
+        }
+        catch (const std::runtime_error &)
+        {
+            caught = true;
+        }
+        assert(caught);
+
+        uint64_t last = wal.LastIndex();
+        wal.Close();
+
+        WAL reopened(path, opts);
+        assert(reopened.LastIndex() == last);
+        for (uint64_t i = 1; i <= last; i++)
+        {
+            assert(reopened.Read(i) == payload(i));
+        }
+        reopened.Close();
+    }
+    {
+        // With no_sync a batch completes as soon as it is written
+        WAL::Options opts;
+        opts.no_sync = true;
+        WAL wal(path, opts);
+        uint64_t next = wal.LastIndex() + 1;
+        WAL::Batch batch;
+        batch.Write(next, payload(next));
+        bool called = false;
+        wal.WriteAsync(&batch, [&](uint64_t i, std::exception_ptr error)
+                       { called = i == next && !error; });
+        assert(called);
+        wal.Close();
+    }
+
+    fs::remove_all(path);
+    std::cout << "WAL async write tests passed\n";
+}
+
+void TestCodecs()
+{
+    std::cout << "Running WAL codec tests...\n";
+
+    std::vector<std::vector<uint8_t>> payloads = {
+        {},
+        {'h', 'e', 'l', 'l', 'o'},
+        {0x00, 0xff, '"', '\n', 0x80},
+        std::vector<uint8_t>(20000, 'x'),
+    };
+    for (auto format : {WAL::LogFormat::Binary, WAL::LogFormat::BinaryV2,
+                        WAL::LogFormat::JSON})
+    {
+        wal_codec::WithCodec(format, [&](auto codec)
+                             {
+            using Codec = decltype(codec);
+            assert(Codec::format == format);
+            std::vector<uint8_t> buf(Codec::segment_header_size, 0);
+            for (size_t i = 0; i < payloads.size(); i++)
+            {
+                Codec::Append(buf, 100 + i, payloads[i].data(), payloads[i].size());
+            }
+
+            wal_codec::Positions epos;
+            assert(Codec::Scan(buf.data(), buf.size(), SIZE_MAX, epos));
+            assert(epos.size() == payloads.size());
+            for (size_t i = 0; i < payloads.size(); i++)
+            {
+                auto data = Codec::Decode(buf.data() + epos[i].first,
+                                          epos[i].second - epos[i].first, 100 + i);
+                assert(data == payloads[i]);
+            }
+
+            // A torn last record is not a boundary
+            epos.clear();
+            assert(!Codec::Scan(buf.data(), buf.size() - 1, SIZE_MAX, epos));
+            assert(epos.size() == payloads.size() - 1); });
+    }
+
+    std::cout << "WAL codec tests passed\n";
+}
+
+void TestColdTier()
+{
+    std::cout << "Running WAL cold tier tests...\n";
+    std::string path = "test_wal_tier";
+    std::string cold = "test_wal_tier_cold";
+    fs::remove_all(path);
+    fs::remove_all(cold);
+
+    auto payload = [](uint64_t i)
+    {
+        std::string s = "tier-" + std::to_string(i);
+        return std::vector<uint8_t>(s.begin(), s.end());
+    };
+    auto countSegments = [](const std::string &dir)
+    {
+        size_t n = 0;
+        for (const auto &entry : fs::directory_iterator(dir))
+        {
+            if (entry.path().filename().string().size() == 20)
+            {
+                n++;
+            }
+        }
+        return n;
+    };
+
+    WAL::Options opts;
+    opts.segment_size = 128;
+    opts.cold_dir = cold;
+    opts.cold_after_entries = 40;
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 200; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        // Wait for the tier thread to catch up
+        for (int i = 0; i < 200 && countSegments(cold) == 0; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        assert(countSegments(cold) > 0);
+        assert(fs::exists(fs::path(path) / "00000000000000000001") ==
+               !fs::exists(fs::path(cold) / "00000000000000000001"));
+
+        // Reads resolve across tiers
+        wal.ClearCache();
+        for (uint64_t i = 1; i <= 200; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+
+        // Recent segments stay hot
+        assert(countSegments(path) >= 2);
+        wal.Close();
+    }
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 200; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+
+        // A front truncation removes cold segments too
+        wal.TruncateFront(60);
+        assert(!fs::exists(fs::path(cold) / "00000000000000000001"));
+
+        // Cutting back into a cold segment brings the new tail home
+        wal.TruncateBack(80);
+        assert(wal.LastIndex() == 80);
+        wal.Write(81, payload(81));
+        assert(wal.Read(81) == payload(81));
+        for (uint64_t i = 60; i <= 80; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+        wal.Close();
+    }
+    {
+        // A move interrupted before the hot file went away: the hot copy
+        // wins and the stale cold one is dropped
+        std::string name;
+        for (const auto &entry : fs::directory_iterator(path))
+        {
+            std::string n = entry.path().filename().string();
+            if (n.size() == 20 && (name.empty() || n < name))
+            {
+                name = n;
+            }
+        }
+        std::ofstream(fs::path(cold) / name, std::ios::binary) << "garbage";
+        WAL wal(path, opts);
+        assert(!fs::exists(fs::path(cold) / name));
+        assert(wal.FirstIndex() == 60);
+        assert(wal.LastIndex() == 81);
+        for (uint64_t i = 60; i <= 81; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+        wal.Close();
+    }
+
+    fs::remove_all(path);
+    fs::remove_all(cold);
+    std::cout << "WAL cold tier tests passed\n";
+}
+
+void TestBlobValues()
+{
+    std::cout << "Running WAL blob value tests...\n";
+    std::string path = "test_wal_blob";
+
+    auto payload = [](uint64_t i)
+    {
+        // Every fifth entry is large
+        size_t size = i % 5 == 0 ? 30000 + i : 10;
+        std::vector<uint8_t> data(size);
+        for (size_t k = 0; k < size; k++)
+        {
+            data[k] = static_cast<uint8_t>(i * 31 + k * 7);
+        }
+        return data;
+    };
+    auto dirBytes = [&path](const std::string &suffix)
+    {
+        uint64_t total = 0;
+        for (const auto &entry : fs::directory_iterator(path))
+        {
+            std::string name = entry.path().filename().string();
+            bool match = suffix.empty() ? name.size() == 20
+                                        : name.size() > suffix.size() &&
+                                              name.compare(name.size() - suffix.size(),
+                                                           suffix.size(), suffix) == 0;
+            if (match)
+            {
+                total += entry.file_size();
+            }
+        }
+        return total;
+    };
+
+    for (auto format : {WAL::LogFormat::BinaryV2, WAL::LogFormat::JSON})
+    {
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 1024;
+        opts.blob_threshold = 4096;
+        {
+            WAL wal(path, opts);
+            for (uint64_t i = 1; i <= 100; i++)
+            {
+                wal.Write(i, payload(i));
+            }
+            // Segments hold references; the values are in blob files
+            assert(dirBytes("") < 20 * 1024);
+            assert(dirBytes(".blob") >= 20 * 30000);
+
+            for (uint64_t i = 1; i <= 100; i++)
+            {
+                assert(wal.Read(i) == payload(i));
+            }
+            wal.ClearCache();
+            for (uint64_t i = 100; i >= 1; i--)
+            {
+                assert(wal.Read(i) == payload(i));
+            }
+            wal.Close();
+        }
+        {
+            WAL wal(path, opts);
+            wal.TruncateFront(21);
+            wal.TruncateBack(77);
+            for (uint64_t i = 78; i <= 90; i++)
+            {
+                wal.Write(i, payload(i));
+            }
+            wal.Close();
+        }
+        {
+            opts.verify_on_open = true;
+            WAL wal(path, opts);
+            assert(wal.FirstIndex() == 21);
+            assert(wal.LastIndex() == 90);
+            for (uint64_t i = 21; i <= 90; i++)
+            {
+                assert(wal.Read(i) == payload(i));
+            }
+
+            // A damaged blob is reported, not returned
+            std::string blob;
+            for (const auto &entry : fs::directory_iterator(path))
+            {
+                std::string name = entry.path().string();
+                if (name.size() > 5 && name.compare(name.size() - 5, 5, ".blob") == 0 &&
+                    name > blob)
+                {
+                    blob = name;
+                }
+            }
+            {
+                std::fstream f(blob, std::ios::binary | std::ios::in | std::ios::out);
+                f.seekp(-1, std::ios::end);
+                f.put('!');
+            }
+            wal.ClearCache();
+            bool caught = false;
+            try
+            {
+                for (uint64_t i = 21; i <= 90; i++)
+                {
+                    wal.Read(i);
+                }
+            }
+            catch (const std::runtime_error &)
+            {
+                caught = true;
+            }
+            assert(caught);
+
+            // A blob file cut short by a crash fails verification
+            wal.Close();
+            fs::resize_file(blob, fs::file_size(blob) - 1);
+            caught = false;
+            try
+            {
+                WAL reopened(path, opts);
+            }
+            catch (const std::runtime_error &)
+            {
+                caught = true;
+            }
+            assert(caught);
+        }
+    }
+
+    {
+        // Binary records have no flags, so values stay inline
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.blob_threshold = 4096;
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 10; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        assert(dirBytes(".blob") == 0);
+        assert(wal.Read(5) == payload(5));
+        wal.Close();
+    }
+
+    {
+        // A batch whose blob can't be written leaves the tail as it was
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = WAL::LogFormat::BinaryV2;
+        opts.blob_threshold = 4096;
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 3; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        std::string tail;
+        for (const auto &entry : fs::directory_iterator(path))
+        {
+            std::string name = entry.path().filename().string();
+            if (name.find_first_not_of("0123456789") == std::string::npos)
+            {
+                tail = entry.path().string();
+            }
+        }
+        fs::create_directory(tail + ".blob");
+
+        WAL::Batch batch;
+        batch.Write(4, payload(4));
+        batch.Write(5, payload(5));
+        bool caught = false;
+        try
+        {
+            wal.WriteBatch(&batch);
+        }
+        catch (const std::runtime_error &)
+        {
+            caught = true;
+        }
+        assert(caught);
+        assert(wal.LastIndex() == 3);
+
+        fs::remove(tail + ".blob");
+        wal.WriteBatch(&batch);
+        for (uint64_t i = 1; i <= 5; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+        wal.Close();
+
+        WAL reopened(path, opts);
+        assert(reopened.LastIndex() == 5);
+        for (uint64_t i = 1; i <= 5; i++)
+        {
+            assert(reopened.Read(i) == payload(i));
+        }
+        reopened.Close();
+    }
+
+    fs::remove_all(path);
+    std::cout << "WAL blob value tests passed\n";
+}
+
+void TestMmapTail()
+{
+    std::cout << "Running WAL mmap tail tests...\n";
+    std::string path = "test_wal_mmap";
+    std::string crashed = "test_wal_mmap_crash";
+
+    auto payload = [](uint64_t i)
+    {
+        // Entry 50 is larger than a segment, so the mapping has to grow
+        size_t size = i == 50 ? 10000 : 1 + i % 97;
+        std::vector<uint8_t> data(size);
+        for (size_t k = 0; k < size; k++)
+        {
+            data[k] = static_cast<uint8_t>(i * 13 + k);
+        }
+        return data;
+    };
+    auto tailFile = [](const std::string &dir)
+    {
+        std::string tail;
+        for (const auto &entry : fs::directory_iterator(dir))
+        {
+            std::string name = entry.path().filename().string();
+            if (name.size() == 20 && name > tail)
+            {
+                tail = name;
+            }
+        }
+        return (fs::path(dir) / tail).string();
+    };
+    auto lastByte = [](const std::string &file)
+    {
+        std::ifstream in(file, std::ios::binary | std::ios::ate);
+        in.seekg(-1, std::ios::end);
+        return in.get();
+    };
+    auto checkAll = [&](WAL &wal, uint64_t last)
+    {
+        assert(wal.FirstIndex() == 1);
+        assert(wal.LastIndex() == last);
+        for (uint64_t i = 1; i <= last; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+    };
+
+    for (auto format : {WAL::LogFormat::BinaryV2, WAL::LogFormat::JSON})
+    {
+        fs::remove_all(path);
+        fs::remove_all(crashed);
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 4096;
+        opts.mmap_tail = true;
+
+        {
+            WAL wal(path, opts);
+            for (uint64_t i = 1; i <= 150; i++)
+            {
+                wal.Write(i, payload(i));
+            }
+            WAL::Batch batch;
+            for (uint64_t i = 151; i <= 180; i++)
+            {
+                batch.Write(i, payload(i));
+            }
+            wal.WriteBatch(&batch);
+            for (uint64_t i = 181; i <= 200; i++)
+            {
+                auto data = payload(i);
+                std::memcpy(wal.Reserve(i, data.size()), data.data(), data.size());
+                wal.Commit();
+            }
+            checkAll(wal, 200);
+
+            // The open tail is preallocated; a copy taken now is what a
+            // crash would leave behind
+            assert(fs::file_size(tailFile(path)) >= opts.segment_size);
+            assert(lastByte(tailFile(path)) == 0);
+            assert(fs::exists(tailFile(path) + ".prealloc"));
+            fs::copy(path, crashed, fs::copy_options::recursive);
+        }
+        // Close trims the tail to its records and drops the marker
+        assert(lastByte(tailFile(path)) != 0);
+        assert(!fs::exists(tailFile(path) + ".prealloc"));
+
+        {
+            WAL wal(path, opts);
+            checkAll(wal, 200);
+            wal.TruncateBack(170);
+            for (uint64_t i = 171; i <= 210; i++)
+            {
+                wal.Write(i, payload(i));
+            }
+            checkAll(wal, 210);
+        }
+        {
+            WAL wal(path, opts);
+            checkAll(wal, 210);
+        }
+
+        // Reopening after a crash cuts the zeros off and appends after them
+        {
+            std::string tail = tailFile(crashed);
+            WAL wal(crashed, opts);
+            checkAll(wal, 200);
+            wal.Write(201, payload(201));
+            wal.Close();
+            assert(!fs::exists(tail + ".prealloc"));
+        }
+        {
+            opts.mmap_tail = false;
+            WAL wal(crashed, opts);
+            checkAll(wal, 201);
+        }
+    }
+
+    // Binary records cannot tell zeros from entries, so that tail is
+    // written through the stream
+    fs::remove_all(path);
+    {
+        WAL::Options opts;
+        opts.log_format = WAL::LogFormat::Binary;
+        opts.segment_size = 4096;
+        opts.mmap_tail = true;
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 20; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        uint64_t bytes = 0;
+        for (uint64_t i = 1; i <= 20; i++)
+        {
+            bytes += payload(i).size() + 1;
+        }
+        assert(fs::file_size(tailFile(path)) == bytes);
+        checkAll(wal, 20);
+    }
+
+    fs::remove_all(path);
+    fs::remove_all(crashed);
+    std::cout << "WAL mmap tail tests passed\n";
+}
+
+void TestSegmentDirectory()
+{
+    std::cout << "Running WAL segment directory tests...\n";
+    std::string path = "test_wal_segdir";
+    fs::remove_all(path);
+
+    auto payload = [](uint64_t i)
+    {
+        std::string s = "entry-" + std::to_string(i);
+        return std::vector<uint8_t>(s.begin(), s.end());
+    };
+
+    WAL::Options opts;
+    opts.segment_size = 64; // a few entries per segment
+    opts.no_sync = true;
+    {
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 3000; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        assert(wal.segments_.size() > 300);
+
+        // Lookups in every order: strided, backwards and repeated
+        for (uint64_t i = 1; i <= 3000; i += 37)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+        for (uint64_t back = 0; back < 3000; back += 11)
+        {
+            uint64_t i = 3000 - back;
+            assert(wal.Read(i) == payload(i));
+            assert(wal.Read(i) == payload(i));
+        }
+        for (const auto &seg : wal.segments_)
+        {
+            assert(wal.Read(seg->index) == payload(seg->index));
+        }
+
+        wal.TruncateFront(1001);
+        wal.TruncateBack(2500);
+        bool threw = false;
+        try
+        {
+            wal.Read(1000);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+        for (uint64_t i = 2501; i <= 2600; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        for (uint64_t i = 2600; i >= 1001; i -= 7)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+    }
+    {
+        WAL wal(path, opts);
+        assert(wal.FirstIndex() == 1001);
+        assert(wal.LastIndex() == 2600);
+        for (uint64_t i = 1001; i <= 2600; i += 13)
+        {
+            assert(wal.Read(i) == payload(i));
+        }
+    }
+
+    fs::remove_all(path);
+    std::cout << "WAL segment directory tests passed\n";
+}
+
+void TestEntryMeta()
+{
+    std::cout << "Running WAL entry metadata tests...\n";
+    std::string path = "test_wal_meta";
+
+    auto payload = [](uint64_t i)
+    {
+        size_t size = i % 25 == 0 ? 5000 : 20 + i % 30;
+        std::vector<uint8_t> data(size);
+        for (size_t k = 0; k < size; k++)
+        {
+            data[k] = static_cast<uint8_t>(i + k * 3);
+        }
+        return data;
+    };
+    // Every fourth entry has none
+    auto metaOf = [](uint64_t i)
+    {
+        WAL::EntryMeta meta;
+        if (i % 4 != 0)
+        {
+            meta.term = i / 10 + 1;
+            meta.type = static_cast<uint32_t>(i % 3);
+        }
+        return meta;
+    };
+    auto checkAll = [&](WAL &wal, uint64_t first, uint64_t last)
+    {
+        auto metas = wal.ReadMeta(first, last);
+        assert(metas.size() == last - first + 1);
+        for (uint64_t i = first; i <= last; i++)
+        {
+            assert(metas[i - first] == metaOf(i));
+            assert(wal.ReadMeta(i) == metaOf(i));
+            assert(wal.Read(i) == payload(i));
+        }
+    };
+
+    for (auto format : {WAL::LogFormat::BinaryV2, WAL::LogFormat::JSON})
+    {
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 2048;
+        opts.blob_threshold = 4096;
+        opts.no_sync = true;
+
+        {
+            WAL wal(path, opts);
+            for (uint64_t i = 1; i <= 200; i++)
+            {
+                auto data = payload(i);
+                wal.Write(i, data.data(), data.size(), metaOf(i));
+            }
+            WAL::Batch batch;
+            for (uint64_t i = 201; i <= 300; i++)
+            {
+                auto data = payload(i);
+                batch.Write(i, data.data(), data.size(), metaOf(i));
+            }
+            wal.WriteBatch(&batch);
+            assert(wal.segments_.size() > 3);
+            checkAll(wal, 1, 300);
+        }
+
+        // Sealed segments read their metadata back on first use
+        {
+            WAL wal(path, opts);
+            assert(wal.ReadMeta(299) == metaOf(299));
+            assert(wal.ReadMeta(7) == metaOf(7));
+            checkAll(wal, 1, 300);
+
+            wal.TruncateFront(50);
+            wal.TruncateBack(250);
+            for (uint64_t i = 251; i <= 260; i++)
+            {
+                auto data = payload(i);
+                wal.Write(i, data.data(), data.size(), metaOf(i));
+            }
+            checkAll(wal, 50, 260);
+            bool threw = false;
+            try
+            {
+                wal.ReadMeta(49);
+            }
+            catch (const std::runtime_error &)
+            {
+                threw = true;
+            }
+            assert(threw);
+        }
+
+        // Conversion keeps metadata between formats that can hold it
+        WAL::Options to = opts;
+        to.log_format = format == WAL::LogFormat::JSON ? WAL::LogFormat::BinaryV2
+                                                       : WAL::LogFormat::JSON;
+        to.blob_threshold = 0;
+        WAL::Convert(path, opts, to);
+        {
+            WAL wal(path, to);
+            checkAll(wal, 50, 260);
+        }
+        WAL::Options binary = to;
+        binary.log_format = WAL::LogFormat::Binary;
+        bool threw = false;
+        try
+        {
+            WAL::Convert(path, to, binary);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    // Binary records have no room for metadata
+    fs::remove_all(path);
+    {
+        WAL::Options opts;
+        opts.log_format = WAL::LogFormat::Binary;
+        WAL wal(path, opts);
+        auto data = payload(1);
+        bool threw = false;
+        try
+        {
+            wal.Write(1, data.data(), data.size(), metaOf(1));
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+        wal.Write(1, data);
+        assert(wal.ReadMeta(1) == WAL::EntryMeta{});
+        assert(wal.Read(1) == data);
+    }
+
+    fs::remove_all(path);
+    std::cout << "WAL entry metadata tests passed\n";
+}
+
+void TestImport()
+{
+    std::cout << "Running WAL import tests...\n";
+    std::string path = "test_wal_import";
+
+    auto payload = [](uint64_t i)
+    {
+        std::vector<uint8_t> data(10 + i % 70);
+        for (size_t k = 0; k < data.size(); k++)
+        {
+            data[k] = static_cast<uint8_t>(i * 7 + k);
+        }
+        return data;
+    };
+    auto metaOf = [](uint64_t i)
+    {
+        WAL::EntryMeta meta;
+        meta.term = i % 3 == 0 ? 0 : i / 100 + 1;
+        return meta;
+    };
+    // Yields entries [from, to], keeping each payload alive until the next call
+    auto source = [&](uint64_t from, uint64_t to)
+    {
+        auto buf = std::make_shared<std::vector<uint8_t>>();
+        return [=](WAL::EntryRef &entry) mutable
+        {
+            if (from > to)
+            {
+                return false;
+            }
+            *buf = payload(from);
+            entry.index = from;
+            entry.data = buf->data();
+            entry.size = buf->size();
+            entry.meta = metaOf(from);
+            from++;
+            return true;
+        };
+    };
+    auto checkAll = [&](WAL &wal, uint64_t last)
+    {
+        assert(wal.LastIndex() == last);
+        for (uint64_t i = 1; i <= last; i++)
+        {
+            assert(wal.Read(i) == payload(i));
+            assert(wal.ReadMeta(i) == metaOf(i));
+        }
+    };
+
+    for (auto format : {WAL::LogFormat::BinaryV2, WAL::LogFormat::JSON})
+    {
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 4096;
+        opts.mmap_tail = format == WAL::LogFormat::JSON;
+
+        {
+            WAL wal(path, opts);
+            // Into an empty log: the first segment replaces the empty tail
+            assert(wal.Import(source(1, 1000), 3) == 1000);
+            checkAll(wal, 1000);
+
+            for (uint64_t i = 1001; i <= 1010; i++)
+            {
+                auto data = payload(i);
+                wal.Write(i, data.data(), data.size(), metaOf(i));
+            }
+            // After a partly filled tail, which is sealed first
+            size_t segs = wal.segments_.size();
+            assert(wal.Import(source(1011, 5000), 4) == 5000);
+            assert(wal.segments_.size() > segs + 10);
+            assert(wal.DurableIndex() == 5000);
+            checkAll(wal, 5000);
+
+            // Nothing to import
+            assert(wal.Import(source(1, 0)) == 5000);
+
+            // Gaps are refused and leave the log as it was
+            bool threw = false;
+            try
+            {
+                wal.Import(source(5002, 5100));
+            }
+            catch (const std::runtime_error &)
+            {
+                threw = true;
+            }
+            assert(threw);
+            assert(!fs::exists(fs::path(path) / "import.tmp"));
+
+            // Writers and truncations wait for the import to finish
+            auto inner = source(5001, 6000);
+            bool refused = false;
+            bool front_refused = false;
+            wal.Import([&](WAL::EntryRef &entry)
+                       {
+                if (!refused)
+                {
+                    try
+                    {
+                        wal.Write(5001, payload(5001));
+                    }
+                    catch (const std::runtime_error &e)
+                    {
+                        refused = std::string(e.what()) == "import in progress";
+                    }
+                    try
+                    {
+                        wal.TruncateFront(2);
+                    }
+                    catch (const std::runtime_error &e)
+                    {
+                        front_refused = std::string(e.what()) == "import in progress";
+                    }
+                }
+                return inner(entry); });
+            assert(refused);
+            assert(front_refused);
+
+            for (uint64_t i = 6001; i <= 6100; i++)
+            {
+                auto data = payload(i);
+                wal.Write(i, data.data(), data.size(), metaOf(i));
+            }
+            checkAll(wal, 6100);
+        }
+        {
+            WAL wal(path, opts);
+            checkAll(wal, 6100);
+            wal.TruncateBack(5500);
+            assert(wal.Import(source(5501, 5600), 2) == 5600);
+            checkAll(wal, 5600);
+        }
+    }
+
+    {
+        // What a crash between moving the segments in and the add edit
+        // leaves behind is not part of the log
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = WAL::LogFormat::BinaryV2;
+        opts.segment_size = 4096;
+        std::string tail;
+        {
+            WAL wal(path, opts);
+            assert(wal.Import(source(1, 500), 2) == 500);
+            tail = wal.segments_.back()->path;
+        }
+        std::string orphan = (fs::path(path) / "00000000000000000501").string();
+        fs::copy_file(tail, orphan);
+        fs::create_directories(fs::path(path) / "import.tmp");
+        {
+            WAL wal(path, opts);
+            checkAll(wal, 500);
+            assert(!fs::exists(orphan));
+            assert(!fs::exists(fs::path(path) / "import.tmp"));
+        }
+
+        // An empty tail dropped ahead of the add edit comes back empty
+        fs::remove_all(path);
+        {
+            WAL wal(path, opts);
+        }
+        {
+            std::ofstream manifest(fs::path(path) / "MANIFEST", std::ios::binary | std::ios::app);
+            manifest << "del=1\n";
+        }
+        {
+            WAL wal(path, opts);
+            assert(wal.FirstIndex() == 0);
+            assert(wal.LastIndex() == 0);
+            assert(wal.Import(source(1, 100)) == 100);
+            checkAll(wal, 100);
+        }
+    }
+
+    fs::remove_all(path);
+    std::cout << "WAL import tests passed\n";
+}
+
+void TestExportRange()
+{
+    std::cout << "Running WAL export tests...\n";
+    std::string path = "test_wal_export";
+    std::string out = "test_wal_export.out";
+
+    auto payload = [](uint64_t i)
+    {
+        std::vector<uint8_t> data(5 + i % 60);
+        for (size_t k = 0; k < data.size(); k++)
+        {
+            data[k] = static_cast<uint8_t>(i * 5 + k);
+        }
+        return data;
+    };
+    // Splits exported records and checks they hold entries [from, to]
+    auto checkRecords = [&](const std::vector<uint8_t> &buf, WAL::LogFormat format,
+                            uint64_t from, uint64_t to)
+    {
+        std::vector<std::pair<size_t, size_t>> epos;
+        if (format == WAL::LogFormat::BinaryV2)
+        {
+            for (size_t pos = 0; pos < buf.size();)
+            {
+                uint32_t len;
+                std::memcpy(&len, buf.data() + pos, 4);
+                epos.emplace_back(pos, pos + 12 + len);
+                pos += 12 + len;
+            }
+        }
+        else
+        {
+            assert(wal_codec::Json::Scan(buf.data(), buf.size(), SIZE_MAX, epos));
+        }
+        assert(epos.size() == to - from + 1);
+        for (uint64_t i = from; i <= to; i++)
+        {
+            const auto &e = epos[i - from];
+            std::vector<uint8_t> data =
+                format == WAL::LogFormat::BinaryV2
+                    ? wal_codec::BinaryV2::Decode(buf.data() + e.first, e.second - e.first, i)
+                    : wal_codec::Json::Decode(buf.data() + e.first, e.second - e.first, i);
+            assert(data == payload(i));
+        }
+    };
+    auto exportToFile = [&](WAL &wal, uint64_t from, uint64_t to)
+    {
+        int fd = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0);
+        uint64_t n = wal.ExportRange(from, to, fd);
+        ::close(fd);
+        std::ifstream in(out, std::ios::binary);
+        std::vector<uint8_t> buf((std::istreambuf_iterator<char>(in)),
+                                 std::istreambuf_iterator<char>());
+        assert(buf.size() == n);
+        return buf;
+    };
+
+    for (auto format : {WAL::LogFormat::BinaryV2, WAL::LogFormat::JSON})
+    {
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 1024;
+
+        {
+            WAL wal(path, opts);
+            for (uint64_t i = 1; i <= 400; i++)
+            {
+                wal.Write(i, payload(i));
+            }
+            // Within one segment, across many, and into the tail
+            checkRecords(exportToFile(wal, 3, 3), format, 3, 3);
+            checkRecords(exportToFile(wal, 1, 400), format, 1, 400);
+            checkRecords(exportToFile(wal, 120, 399), format, 120, 399);
+
+            // To a socket, which takes the sendfile path
+            int sv[2];
+            assert(::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+            std::vector<uint8_t> received;
+            std::thread reader([&]()
+                               {
+                uint8_t chunk[4096];
+                ssize_t n;
+                while ((n = ::read(sv[1], chunk, sizeof(chunk))) > 0)
+                {
+                    received.insert(received.end(), chunk, chunk + n);
+                } });
+            uint64_t sent = wal.ExportRange(50, 350, sv[0]);
+            ::shutdown(sv[0], SHUT_WR);
+            reader.join();
+            ::close(sv[0]);
+            ::close(sv[1]);
+            assert(received.size() == sent);
+            checkRecords(received, format, 50, 350);
+
+            bool threw = false;
+            try
+            {
+                wal.ExportRange(390, 401, sv[0]);
+            }
+            catch (const std::runtime_error &)
+            {
+                threw = true;
+            }
+            assert(threw);
+        }
+
+        // Sealed segments found on open go through their offset index, or
+        // rebuild it when it is gone
+        for (const auto &entry : fs::directory_iterator(path))
+        {
+            if (entry.path().extension() == ".idx")
+            {
+                fs::remove(entry.path());
+                break;
+            }
+        }
+        {
+            WAL wal(path, opts);
+            wal.TruncateFront(10);
+            checkRecords(exportToFile(wal, 10, 400), format, 10, 400);
+        }
+    }
+
+    {
+        // A back truncation that cuts the bytes of a running export fails it
+        fs::remove_all(path);
+        WAL wal(path, WAL::Options());
+        for (uint64_t i = 1; i <= 3000; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        int fds[2];
+        assert(::pipe(fds) == 0);
+        std::string error;
+        std::thread exporter([&]()
+                             {
+            try
+            {
+                wal.ExportRange(1, 3000, fds[1]);
+            }
+            catch (const std::runtime_error &e)
+            {
+                error = e.what();
+            }
+            ::close(fds[1]); });
+        // Wait until the copy is under way, blocked on the full pipe
+        for (int queued = 0; queued < 4096;)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            assert(::ioctl(fds[0], FIONREAD, &queued) == 0);
+        }
+        wal.TruncateBack(10);
+        for (uint64_t i = 11; i <= 3000; i++)
+        {
+            wal.Write(i, payload(i + 1));
+        }
+        char buf[4096];
+        while (::read(fds[0], buf, sizeof(buf)) > 0)
+        {
+        }
+        exporter.join();
+        ::close(fds[0]);
+        assert(error == "entry truncated");
+    }
+
+    // Blob references would be useless to the receiver; entries 1 to 26
+    // are below the threshold and export from the same segments
+    for (auto format : {WAL::LogFormat::BinaryV2, WAL::LogFormat::JSON})
+    {
+        fs::remove_all(path);
+        WAL::Options opts;
+        opts.log_format = format;
+        opts.segment_size = 1024;
+        opts.blob_threshold = 32;
+        WAL wal(path, opts);
+        for (uint64_t i = 1; i <= 200; i++)
+        {
+            wal.Write(i, payload(i));
+        }
+        checkRecords(exportToFile(wal, 1, 26), format, 1, 26);
+        checkRecords(exportToFile(wal, 125, 146), format, 125, 146);
+        bool threw = false;
+        try
+        {
+            exportToFile(wal, 20, 30);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    fs::remove_all(path);
+    fs::remove(out);
+    std::cout << "WAL export tests passed\n";
+}
+
 int main()
 {
     try
@@ -262,6 +2652,31 @@ int main()
         TestJSONFormat();
         TestStringWithJSONFormat();
         TestSmallSegmentWithCache();
+        TestTruncateBackInPlace();
+        TestManifest();
+        TestVerifyOnOpen();
+        TestWALGroup();
+        TestReadahead();
+        TestWriteOverloads();
+        TestReserveCommit();
+        TestAppendNext();
+        TestBase64AndUTF8();
+        TestSegmentScan();
+        TestConvert();
+        TestBinaryV2();
+        TestPointRead();
+        TestBlockCache();
+        TestCheckpoint();
+        TestSyncPolicy();
+        TestWriteAsync();
+        TestCodecs();
+        TestColdTier();
+        TestBlobValues();
+        TestMmapTail();
+        TestSegmentDirectory();
+        TestEntryMeta();
+        TestImport();
+        TestExportRange();
         std::cout << "All tests passed\n";
     }
     catch (const std::exception &e)
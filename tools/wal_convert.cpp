@@ -0,0 +1,77 @@
+#include "wal.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+static void usage()
+{
+    std::cerr << "usage: wal_convert <dir> <from> <to> [--segment-size BYTES] [--threads N]\n"
+              << "  <from>, <to>: binary | binary2 | json\n";
+}
+
+static bool parseFormat(const std::string &name, WAL::LogFormat *format)
+{
+    if (name == "binary")
+    {
+        *format = WAL::LogFormat::Binary;
+        return true;
+    }
+    if (name == "binary2")
+    {
+        *format = WAL::LogFormat::BinaryV2;
+        return true;
+    }
+    if (name == "json")
+    {
+        *format = WAL::LogFormat::JSON;
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        usage();
+        return 2;
+    }
+
+    WAL::Options from;
+    WAL::Options to;
+    size_t threads = 0;
+    if (!parseFormat(argv[2], &from.log_format) || !parseFormat(argv[3], &to.log_format))
+    {
+        usage();
+        return 2;
+    }
+    for (int i = 4; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--segment-size") == 0 && i + 1 < argc)
+        {
+            to.segment_size = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    try
+    {
+        WAL::Convert(argv[1], from, to, threads);
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "wal_convert: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}